@@ -2,9 +2,12 @@
 #define CAMERA_H_
 
 #include "print.hpp" //print_txt
+#include "scalar.hpp" //ekf_scalar
+#include "camera_distortion.hpp" //NoDistortion, RadialDistortion, EquidistantDistortion
 
-#include <Eigen/Dense> //Matrix3d
+#include <Eigen/Dense> //Matrix3s
 #include <iostream> //cout
+#include <algorithm> //max
 
 /*
  * Notation:
@@ -15,32 +18,55 @@
  * p = point in cartesian coordinates with origin on the current camera position
  */
 
-class Camera {
+/*
+ * CameraModel:
+ * Pinhole projection (fx, fy, cx, cy) followed by the lens distortion of the Distortion policy (camera_distortion.hpp). Every
+ * function is defined here so that the projection and its Jacobians are inlined into Feature and Kalman.
+ */
+template <class Distortion>
+class CameraModel {
 private:
-	Eigen::Matrix3d K_;
-	double fx_;
-	double fy_;
-	double cx_;
-	double cy_;
-	double k1_;
-	double k2_;
-	Eigen::Matrix<double, 3, 2> dgc_dhu_;
+	Matrix3s K_;
+	ekf_scalar fx_;
+	ekf_scalar fy_;
+	ekf_scalar cx_;
+	ekf_scalar cy_;
+	Distortion distortion_;
+	Eigen::Matrix<ekf_scalar, 3, 2> dgc_dhu_;
+
+	void initialize(){
+		K_ << fx_,   0, cx_,
+		        0, fy_, cy_,
+		 	    0,   0,   1;
+
+		dgc_dhu_ << 1/fx_,     0,
+				        0, 1/fy_,
+				        0,     0;
+
+		//Distorted radius of the corners of an image centered at (cx, cy):
+		distortion_.initialize(sqrt((cx_/fx_)*(cx_/fx_) + (cy_/fy_)*(cy_/fy_)), std::max(fx_, fy_));
+	}
 
 public:
-	Camera(double fx, double fy, double cx, double cy, double k1, double k2) :
+	CameraModel(ekf_scalar fx, ekf_scalar fy, ekf_scalar cx, ekf_scalar cy, const Distortion & distortion = Distortion()) :
+		fx_(fx),
+		fy_(fy),
+		cx_(cx),
+		cy_(cy),
+		distortion_(distortion){
+		initialize();
+	}
+
+	/*
+	 * Only for RadialDistortion, see it for distortion_table_max_error.
+	 */
+	CameraModel(ekf_scalar fx, ekf_scalar fy, ekf_scalar cx, ekf_scalar cy, ekf_scalar k1, ekf_scalar k2, ekf_scalar distortion_table_max_error = 0) :
 		fx_(fx),
 		fy_(fy),
 		cx_(cx),
 		cy_(cy),
-		k1_(k1),
-		k2_(k2){
-		K_ << fx,  0, cx,
-		       0, fy, cy,
-		 	   0,  0,  1;
-
-		dgc_dhu_ << 1/fx,    0,
-				       0, 1/fy,
-				       0,    0;
+		distortion_(k1, k2, distortion_table_max_error){
+		initialize();
 	}
 
 
@@ -48,44 +74,143 @@ public:
 	 * undistort:
 	 * Remove the distortion of an image coordinate: uvd -> uvu
 	 */
-	void undistort( const Eigen::Vector2d & uvd, Eigen::Vector2d & uvu) const;
+	void undistort( const Vector2s & uvd, Vector2s & uvu) const{
+		//convert from image coordinates to the projection plane coordinates (inv(K_) * [uvd ; 1]):
+		ekf_scalar xd = (uvd(0) - cx_)/fx_;
+		ekf_scalar yd = (uvd(1) - cy_)/fy_;
+
+		//Undistort (xyd -> xyu):
+		ekf_scalar factor = distortion_.undistortion_factor(xd*xd + yd*yd);
+		ekf_scalar xu = xd*factor;
+		ekf_scalar yu = yd*factor;
+
+		//return from the linear projection plane coordinate system to the image coordinate system (K_ * [xu ; yu ; 1]):
+		uvu << xu*fx_ + cx_,
+	           yu*fy_ + cy_;
+	}
 
 	/*
 	 * Jacobian of undistort function wrt. distorted image coords. jacobian(uvu, uvd): UVU_uvd
 	 */
-	void jacob_undistort(const Eigen::Vector2d & uvd, Eigen::Matrix2d & UVU_uvd) const;
+	void jacob_undistort(const Vector2s & uvd, Matrix2s & UVU_uvd) const{
+		//convert from image coordinates to the projection plane coordinates (inv(K_) * [uvd ; 1]):
+		ekf_scalar xd=(uvd(0) - cx_)/fx_;
+		ekf_scalar yd=(uvd(1) - cy_)/fy_;
+
+		//xu = xd*factor(rd^2), so dxu_dxd = factor + 2*xd*xd*dfactor, dxu_dyd = 2*xd*yd*dfactor (and the same for yu):
+		ekf_scalar rd2 = xd*xd + yd*yd;
+		ekf_scalar factor = distortion_.undistortion_factor(rd2);
+		ekf_scalar dfactor = 2*distortion_.undistortion_factor_derivative(rd2);
+
+		ekf_scalar uu_ud = factor + xd*xd*dfactor;
+		ekf_scalar vu_vd = factor + yd*yd*dfactor;
+		ekf_scalar uu_vd = xd*yd*dfactor*fx_/fy_;
+		ekf_scalar vu_ud = xd*yd*dfactor*fy_/fx_;
+
+		UVU_uvd << uu_ud,uu_vd,
+	               vu_ud,vu_vd;
+	}
 
 	/*
 	 * distort:
-	 * Apply the radial distortion to an image coordinate: uvu -> uvd
+	 * Apply the lens distortion to an image coordinate: uvu -> uvd
 	 */
-	void distort( const Eigen::Vector2d & uvu, Eigen::Vector2d & uvd ) const;
+	void distort( const Vector2s & uvu, Vector2s & uvd ) const{
+		//convert from image coordinates to the projection plane coordinates (inv(K_) * [uvu ; 1]):
+		ekf_scalar xu=(uvu(0) - cx_)/fx_;
+		ekf_scalar yu=(uvu(1) - cy_)/fy_;
+
+		ekf_scalar factor = distortion_.distortion_factor(xu*xu + yu*yu);
+		ekf_scalar xd = xu/factor;
+		ekf_scalar yd = yu/factor;
+
+		//return from the linear projection plane coordinate system to the image coordinate system (K_ * [xd ; yd ; 1]):
+		uvd << xd*fx_ + cx_,
+	           yd*fy_ + cy_;
+	}
 
 	/*
 	 * Takes a distorted image pixel (uvd) and transforms it to homogeneous coordinates (undistorted and centered aroundZ axis)
 	 */
-	void uvd_to_homogeneous( const Eigen::Vector2d & uvd, Eigen::Vector3d & homogeneous_projection )  const;
+	void uvd_to_homogeneous( const Vector2s & uvd, Vector3s & homogeneous_projection )  const{
+		Vector2s uvu;
+		undistort(uvd, uvu);
+
+		uvu_to_homogeneous(uvu, homogeneous_projection);
+	}
 
 	/*
 	 * Takes an undistorted image pixel (uvu) and transforms it to homogeneous coordinates (undistorted and centered aroundZ axis)
 	 */
-	void uvu_to_homogeneous( const Eigen::Vector2d & uvu, Eigen::Vector3d & homogeneous_projection )  const;
+	void uvu_to_homogeneous( const Vector2s & uvu, Vector3s & homogeneous_projection )  const{
+		////inv(K_) * [uvu ; 1] = homogeneous
+		homogeneous_projection(0)=(uvu(0) - cx_)/fx_;
+		homogeneous_projection(1)=(uvu(1) - cy_)/fy_;
+		homogeneous_projection(2)=1;
+	}
 
 	/*
 	 * % Jacobian of undistorted image point to homogeneous function wrt. uvu. jacobian(uvu_to_homogeneous, uvu) = UVUTOHOMOGENEOUS_uvu
 	 */
-	void jacob_uvu_to_homogeneous(Eigen::Matrix<double, 3, 2> & UVUTOHOMOGENEOUS_uvu) const;
+	void jacob_uvu_to_homogeneous(Eigen::Matrix<ekf_scalar, 3, 2> & UVUTOHOMOGENEOUS_uvu) const{
+		UVUTOHOMOGENEOUS_uvu = dgc_dhu_;
+	}
 
 	/*
 	 * Point p projection to undistorted image coordinates?: p to uvu
 	 */
-	void project_p_to_uvu( const Eigen::Vector3d & p, Eigen::Vector2d & uvu ) const;
+	void project_p_to_uvu( const Vector3s & p, Vector2s & uvu ) const{
+		//K_ * p = uvu
+		uvu(0) = cx_ + (p(0)/p(2))*fx_;
+		uvu(1) = cy_ + (p(1)/p(2))*fx_;
+	}
 
 	/*
 	 * Jacobian of point projection function wrt. to point p: jacobian(UVU_p)
 	 */
-	void jacob_project_p_to_uvu(const Eigen::Vector3d & p, Eigen::Matrix<double, 2, 3> & UVU_p) const;
+	void jacob_project_p_to_uvu(const Vector3s & p, Eigen::Matrix<ekf_scalar, 2, 3> & UVU_p) const{
+		ekf_scalar x = p(0);
+		ekf_scalar y = p(1);
+		ekf_scalar z = p(2);
+		UVU_p << fx_/z,     0, -(x*fx_)/(z*z),
+	                 0, fy_/z, -(y*fy_)/(z*z);
+	}
+
+	/*
+	 * Batched project_p_to_uvu followed by distort: p to uvd for many points at once, as a structure of arrays (x, y and z of the
+	 * points, u and v of their projections). It runs with Eigen array expressions, vectorized over the points (SSE/AVX, or NEON in
+	 * single precision), Newton iterations of the distortion included (the distortion table lookups, if any, are done point by point).
+	 */
+	void project_p_to_uvd( const FeaturesArray & x, const FeaturesArray & y, const FeaturesArray & z, FeaturesArray & ud, FeaturesArray & vd ) const{
+		//project_p_to_uvu, directly in the projection plane coordinates (inv(K_) * [uvu ; 1]), with the same scale as it for v:
+		const FeaturesArray xu = x/z;
+		const FeaturesArray yu = (y/z)*(fx_/fy_);
+
+		FeaturesArray factor;
+		distortion_.distortion_factor(xu.square() + yu.square(), factor);
+
+		//return from the linear projection plane coordinate system to the image coordinate system (K_ * [xd ; yd ; 1]):
+		ud = cx_ + fx_*xu/factor;
+		vd = cy_ + fy_*yu/factor;
+	}
 
 };
 
+typedef CameraModel<NoDistortion> PinholeCamera;
+typedef CameraModel<RadialDistortion> RadialCamera;
+typedef CameraModel<EquidistantDistortion> FisheyeCamera;
+
+/*
+ * The camera model of the filter (Feature and Kalman), chosen at compile time (EKFOA_CAMERA_MODEL in CMakeLists.txt):
+ * EKFOA_CAMERA_PINHOLE for rectified input, EKFOA_CAMERA_FISHEYE for equidistant fisheye lenses, the two parameter radial
+ * distortion otherwise.
+ */
+#if defined(EKFOA_CAMERA_PINHOLE)
+typedef PinholeCamera Camera;
+#elif defined(EKFOA_CAMERA_FISHEYE)
+typedef FisheyeCamera Camera;
+#else
+typedef RadialCamera Camera;
+#endif
+
 #endif
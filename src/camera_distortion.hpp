@@ -0,0 +1,179 @@
+#ifndef CAMERA_DISTORTION_H_
+#define CAMERA_DISTORTION_H_
+
+#include "scalar.hpp" //ekf_scalar
+
+#include <math.h>
+#include <vector> //vector
+
+/*
+ * Lens distortion models, the distortion policy of CameraModel (camera.hpp). They are radially symmetric and work in projection
+ * plane coordinates (xyu, xyd), through two factors of the squared radius:
+ *  xu = xd*undistortion_factor(rd^2)
+ *  xd = xu/distortion_factor(ru^2)
+ * and d(undistortion_factor)/d(rd^2) for the Jacobian of undistort. Everything is inline so that the chosen model is compiled into
+ * Feature and Kalman.
+ *
+ * initialize is called by the camera with the distorted radius of the image corners and the focal length (pixels).
+ */
+
+/*
+ * NoDistortion:
+ * Pinhole camera, or images that have already been rectified.
+ */
+class NoDistortion {
+public:
+	void initialize(const ekf_scalar /*image_radius*/, const ekf_scalar /*focal_length*/){}
+
+	ekf_scalar undistortion_factor(const ekf_scalar /*rd2*/) const{
+		return 1;
+	}
+
+	ekf_scalar undistortion_factor_derivative(const ekf_scalar /*rd2*/) const{
+		return 0;
+	}
+
+	ekf_scalar distortion_factor(const ekf_scalar /*r2*/) const{
+		return 1;
+	}
+
+	void distortion_factor(const FeaturesArray & r2, FeaturesArray & factor) const{
+		factor.setOnes(r2.rows());
+	}
+};
+
+/*
+ * RadialDistortion:
+ * Two parameter radial distortion, xu = xd*(1 + k1*rd^2 + k2*rd^4). Its inverse has no closed form, it is solved by Newton
+ * iterations or looked up in a table.
+ *
+ * table_max_error: if positive, the distortion factor is looked up in a table (built by initialize) instead of solved, with at
+ * most this error (pixels) over the image and a margin around it.
+ */
+class RadialDistortion {
+private:
+	ekf_scalar k1_;
+	ekf_scalar k2_;
+	ekf_scalar table_max_error_;
+
+	//Distortion factor (1 + k1*rd^2 + k2*rd^4) against the squared undistorted radius (r^2), sampled every table_step_ from 0
+	//and linearly interpolated. Empty if it is solved with Newton iterations on every call:
+	std::vector<ekf_scalar> table_;
+	ekf_scalar table_step_;
+
+	/*
+	 * The distorted radius (rd) solves rd*(1 + k1*rd^2 + k2*rd^4) = r, by Newton iterations.
+	 */
+	ekf_scalar distortion_factor_newton(const ekf_scalar r2) const{
+		ekf_scalar r4 = r2*r2;
+
+		ekf_scalar r=sqrt(r2);
+		ekf_scalar rd=r/(1+k1_*r2+k2_*r4);
+
+		ekf_scalar f, f_p;
+		for (int i=0 ; i<10 ; i++){
+			f = rd + k1_*rd*rd*rd + k2_*rd*rd*rd*rd*rd - r;
+			f_p = 1 + 3*k1_*rd*rd + 5*k2_*rd*rd*rd*rd;
+			rd = rd - f/f_p;
+		}
+
+		ekf_scalar rd2 = rd*rd;
+
+		return 1 + k1_*rd2 + k2_*rd2*rd2;
+	}
+
+public:
+	RadialDistortion(ekf_scalar k1, ekf_scalar k2, ekf_scalar table_max_error = 0) :
+		k1_(k1),
+		k2_(k2),
+		table_max_error_(table_max_error),
+		table_step_(0){}
+
+	void initialize(const ekf_scalar image_radius, const ekf_scalar focal_length);
+
+	ekf_scalar undistortion_factor(const ekf_scalar rd2) const{
+		return 1 + k1_*rd2 + k2_*rd2*rd2;
+	}
+
+	ekf_scalar undistortion_factor_derivative(const ekf_scalar rd2) const{
+		return k1_ + 2*k2_*rd2;
+	}
+
+	/*
+	 * distortion_factor_newton, interpolated from the table if it covers r2.
+	 */
+	ekf_scalar distortion_factor(const ekf_scalar r2) const{
+		if (!table_.empty()){
+			const ekf_scalar position = r2/table_step_;
+			if (position < table_.size() - 1){
+				const int i = (int)position;
+				const ekf_scalar t = position - i;
+				return table_[i] + t*(table_[i+1] - table_[i]);
+			}
+		}
+
+		return distortion_factor_newton(r2);
+	}
+
+	/*
+	 * Batched distortion_factor: the same Newton iterations for every point (or a table lookup each).
+	 */
+	void distortion_factor(const FeaturesArray & r2, FeaturesArray & factor) const{
+		factor.resize(r2.rows());
+
+		if (table_.empty()){
+			const FeaturesArray r = r2.sqrt();
+			FeaturesArray rd = r/(1 + k1_*r2 + k2_*r2.square());
+
+			for (int i=0 ; i<10 ; i++){
+				const FeaturesArray rd2 = rd.square();
+				rd -= (rd*(1 + k1_*rd2 + k2_*rd2.square()) - r)/(1 + 3*k1_*rd2 + 5*k2_*rd2.square());
+			}
+
+			const FeaturesArray rd2 = rd.square();
+			factor = 1 + k1_*rd2 + k2_*rd2.square();
+		} else {
+			for (int i=0 ; i<r2.rows() ; i++){
+				factor(i) = distortion_factor(r2(i));
+			}
+		}
+	}
+};
+
+/*
+ * EquidistantDistortion:
+ * Fisheye lens with an equidistant projection: the distorted radius is the angle of the ray to the optical axis, rd = atan(r).
+ * It covers fields of view wider than the pinhole model, up to (but not including) 180 degrees.
+ */
+class EquidistantDistortion {
+public:
+	void initialize(const ekf_scalar /*image_radius*/, const ekf_scalar /*focal_length*/){}
+
+	//tan(rd)/rd
+	ekf_scalar undistortion_factor(const ekf_scalar rd2) const{
+		const ekf_scalar rd = sqrt(rd2);
+		return rd > 0 ? tan(rd)/rd : 1;
+	}
+
+	ekf_scalar undistortion_factor_derivative(const ekf_scalar rd2) const{
+		if (rd2 < 1e-4){
+			return 1.0/3 + 4*rd2/15; //Taylor series, the closed form cancels out near the center
+		}
+		const ekf_scalar rd = sqrt(rd2);
+		const ekf_scalar cos_rd = cos(rd);
+		return (rd/(cos_rd*cos_rd) - tan(rd))/(2*rd2*rd);
+	}
+
+	//r/atan(r)
+	ekf_scalar distortion_factor(const ekf_scalar r2) const{
+		const ekf_scalar r = sqrt(r2);
+		return r > 0 ? r/atan(r) : 1;
+	}
+
+	void distortion_factor(const FeaturesArray & r2, FeaturesArray & factor) const{
+		const FeaturesArray r = r2.sqrt();
+		factor = (r > 0).select(r/r.atan(), ekf_scalar(1));
+	}
+};
+
+#endif
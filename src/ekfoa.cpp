@@ -31,10 +31,28 @@ cam(Camera(
 		588.878779108602,   //fx
 		588.643674196636,   //fy
 		303.725019622098,   //cx
-		185.837132396075,   //cy
+		185.837132396075    //cy
+#if !defined(EKFOA_CAMERA_PINHOLE) && !defined(EKFOA_CAMERA_FISHEYE)
+		,
 		-0.550446697998159, //k1
-		0.311341231340524   //k2
+		0.311341231340524,  //k2
+
+		0.01 //maximum error (pixels) of the distortion lookup table
+#endif
 )),
+#ifdef EKFOA_RECTIFY_INPUT
+//The distortion of the ARDRONE calibration above, removed from the frames:
+rectifier(ImageRectifier(RadialCamera(
+		588.878779108602,   //fx
+		588.643674196636,   //fy
+		303.725019622098,   //cx
+		185.837132396075,   //cy
+		-0.550446697998159, //k1
+		0.311341231340524,  //k2
+
+		0.01 //maximum error (pixels) of the distortion lookup table (only used to build the rectification maps)
+))),
+#endif
 filter(Kalman(
 		0.0,   //v_0
 		0.025, //std_v_0
@@ -45,10 +63,18 @@ filter(Kalman(
 		1.0    //standar deviation for measurement noise
 )),
 motion_tracker(MotionTrackerOF(
-		30, //min_number_of_features_in_image
-		20  //distance_between_points
+		EKFOA_TRACKED_FEATURES, //min_number_of_features_in_image
+		20                      //distance_between_points
 )) {
-
+	//The tracker keeps around min_number_of_features_in_image features, reserve room for them so that adding and deleting features does not reallocate the filter:
+	filter.reserve_features(EKFOA_TRACKED_FEATURES);
+	//Hard limit of features in the state, the tracker's, so the cost of the update is bounded. The ones farthest from the flight path are evicted first:
+	filter.set_max_features(EKFOA_TRACKED_FEATURES, &eviction_policy);
+	//Features whose depth has converged are switched to Cartesian points (3 values instead of 6), with the linearity index threshold of Civera et al.:
+	filter.set_cartesian_linearity_threshold(0.1);
+	//New features store their ray direction instead of its azimuth and elevation, so projecting them needs no trigonometric functions:
+	filter.set_new_features_parametrization(Feature::ANCHORED_HOMOGENEOUS);
+	//Every feature is tracked back (MotionTrackerOF::VERIFY_ALL) until the thresholds of VERIFY_ADAPTIVE are measured on the sequences.
 }
 
 void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW, Eigen::Vector4d & qWR, Eigen::Matrix3d & axes_orientation_and_confidence, std::vector<Point3d> (& XYZs)[3], Delaunay & triangulation, Point3d & closest_point){
@@ -56,10 +82,19 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 	std::vector<cv::Point2f> features_to_add;
 	std::vector<Features_extra> features_extra;
 
+	time_total = (double)cv::getTickCount();
+
+#ifdef EKFOA_RECTIFY_INPUT
+	//Undistort the whole frame once, instead of every feature in the filter:
+	double time_rectify = (double)cv::getTickCount();
+	frame = rectifier.rectify(frame); //a header of the rectifier's buffer, the input one is not written
+	time_rectify = (double)cv::getTickCount() - time_rectify;
+//	std::cout << "rectify = " << time_rectify/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
+#endif
+
 	/*
 	 * EKF prediction (state and measurement prediction)
 	 */
-	time_total = (double)cv::getTickCount();
 	double time_prediction = (double)cv::getTickCount();
 	filter.predict_state_and_covariance(delta_t);
 	filter.compute_features_h(cam, features_extra);
@@ -86,14 +121,15 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 	 * EKF Update step and map management (add new features to EKF)
 	 */
 	double time_update = (double)cv::getTickCount();
-	filter.update(cam, features_extra);
+	filter.update(features_extra);
 	time_update = (double)cv::getTickCount() - time_update;
 //	std::cout << "update  = " << time_update/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
 
 
 	//Add new features
 	double time_add = (double)cv::getTickCount();
-	filter.add_features_inverse_depth(cam, features_to_add);
+	const int num_added = filter.add_features_inverse_depth(cam, features_to_add);
+	motion_tracker.keep_added_features(num_added); //the ones over the filter limit are not tracked either
 	time_add = (double)cv::getTickCount() - time_add;
 //	std::cout << "add_fea = " << time_add/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
 
@@ -106,20 +142,20 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 	std::vector< std::pair<Point2d, size_t> > triangle_list;
 	std::list<Triangle> triangles_list_3d;
 
-	const Eigen::VectorXd & x_k_k = filter.x_k_k();
-	const Eigen::MatrixXd & p_k_k = filter.p_k_k();
+	const VectorXs & x_k_k = filter.x_k_k();
+	const Eigen::Block<const Kalman::CovarianceMatrix> p_k_k = filter.p_k_k(); //a view, the covariance matrix is not copied
 
 	//Set the position, so the GUI can draw it:
-	rW = x_k_k.segment<3>(0);//current position
+	rW = x_k_k.segment<3>(0).cast<double>();//current position (the filter may run in single precision)
 
 	//Set the axes orientation and confidence:
 	axes_orientation_and_confidence.setIdentity();//axes_orientation_and_confidence stores in each column one axis (X, Y, Z)
 	axes_orientation_and_confidence *= 5; //make the lines larger, so they are actually informative
 	//Apply rotation matrix:
-	Eigen::Matrix3d qWR_R;//Rotation matrix of current orientation quaternion
-	qWR = x_k_k.segment<4>(3);
-	MotionModel::quaternion_matrix(qWR, qWR_R);
-	axes_orientation_and_confidence.applyOnTheLeft(qWR_R); // == R * axes_orientation_and_confidence
+	Matrix3s qWR_R;//Rotation matrix of current orientation quaternion
+	qWR = x_k_k.segment<4>(3).cast<double>();
+	MotionModel::quaternion_matrix(x_k_k.segment<4>(3), qWR_R);
+	axes_orientation_and_confidence.applyOnTheLeft(qWR_R.cast<double>()); // == R * axes_orientation_and_confidence
 	for (int axis=0 ; axis<axes_orientation_and_confidence.cols() ; axis++){
 		//Set the length to be 3*sigma:
 		axes_orientation_and_confidence.col(axis) *= 3*std::sqrt(p_k_k(axis, axis)); //the first 3 positions of the cov matrix define the confidence for the position
@@ -127,31 +163,41 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 		axes_orientation_and_confidence.col(axis) += rW;
 	}
 
-	int num_features = (x_k_k.rows()-13)/6;
+	std::vector<Features_extra> features_layout; //where each feature is in the state (including the ones just added)
+	filter.features_layout(features_layout);
+	int num_features = features_layout.size();
 	XYZs[0].resize(num_features);
 	XYZs[1].resize(num_features);
 	XYZs[2].resize(num_features);
 
 
 	//Compute the 3d positions and inverse depth variances of all the points in the state
-	int i=0; //Feature counter
-	for (int start_feature=13 ; start_feature<x_k_k.rows() ; start_feature+=6){
-		const int feature_inv_depth_index = start_feature + 5;
+	for (int i=0 ; i<num_features ; i++){ //i: Feature counter
+		const int start_feature = features_layout[i].yi_start_pos;
+		if (features_layout[i].parametrization == Feature::CARTESIAN){
+			//Its depth has converged (Kalman::convert_features_to_cartesian), so it is part of the surface:
+			Vector3s XYZ = x_k_k.segment<3>(start_feature);
+			XYZs[0][i] = XYZs[1][i] = XYZs[2][i] = Point3d(XYZ(0), XYZ(1), XYZ(2));
+			triangle_list.push_back(std::make_pair(Point2d(features_extra[i].z(0), features_extra[i].z(1)), i));
+			continue;
+		}
+
+		const int feature_inv_depth_index = start_feature + features_layout[i].yi_size - 1;
 
 		//As with any normal distribution, nearly all (99.73%) of the possible depths lie within three standard deviations of the mean!
 		const double sigma_3 = std::sqrt(p_k_k(feature_inv_depth_index, feature_inv_depth_index)); //sqrt(depth_variance)
 
-		const Eigen::VectorXd & yi = x_k_k.segment(start_feature, 6);
-		Eigen::VectorXd point_close(x_k_k.segment(start_feature, 6));
-		Eigen::VectorXd point_far(x_k_k.segment(start_feature, 6));
+		const Feature::StateVector yi = Kalman::feature_state(x_k_k, features_layout[i]);
+		Feature::StateVector point_close(yi);
+		Feature::StateVector point_far(yi);
 
 		//Change the depth of the feature copy, so that it is possible to represent the range between -3*sigma and 3*sigma:
-		point_close(5) += sigma_3;
-		point_far(5) -= sigma_3;
+		point_close(yi.rows() - 1) += sigma_3;
+		point_far(yi.rows() - 1) -= sigma_3;
 
-		Eigen::Vector3d XYZ_mu = (Feature::compute_cartesian(yi)); //mu (mean)
-		Eigen::Vector3d XYZ_close = (Feature::compute_cartesian(point_close)); //mean + 3*sigma. (since inverted signs are also inverted)
-		Eigen::Vector3d XYZ_far = (Feature::compute_cartesian(point_far)); //mean - 3*sigma
+		Vector3s XYZ_mu = (Feature::compute_cartesian(yi)); //mu (mean)
+		Vector3s XYZ_close = (Feature::compute_cartesian(point_close)); //mean + 3*sigma. (since inverted signs are also inverted)
+		Vector3s XYZ_far = (Feature::compute_cartesian(point_far)); //mean - 3*sigma
 
 		//The center of the model is ALWAYS the current position of the camera/robot, so have to 'cancel' the current orientation (R_inv) and translation (rWC = x_k_k.head(3)):
 		//Note: It is nicer to do this in the GUI class, as it is only a presention/perspective change. But due to the structure, it was easier to do it here.
@@ -168,19 +214,13 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 		if (x_k_k(feature_inv_depth_index) < 0 ){
 			std::cout << "feature behind the camera!!! : idx=" << i << ", value=" << x_k_k(feature_inv_depth_index) << std::endl;
 		}
-		i++;
 	}
 
 	triangulation.insert(triangle_list.begin(), triangle_list.end());
 
-	cv::Scalar delaunay_color = cv::Scalar(255, 0, 0); //blue
 	for(Delaunay::Finite_faces_iterator fit = triangulation.finite_faces_begin(); fit != triangulation.finite_faces_end(); ++fit) {
 		const Delaunay::Face_handle & face = fit;
 		//face->vertex(i)->info() = index of the point in the observation list.
-		line(frame, features_extra[face->vertex(0)->info()].z_cv, features_extra[face->vertex(1)->info()].z_cv, delaunay_color, 1);
-		line(frame, features_extra[face->vertex(1)->info()].z_cv, features_extra[face->vertex(2)->info()].z_cv, delaunay_color, 1);
-		line(frame, features_extra[face->vertex(2)->info()].z_cv, features_extra[face->vertex(0)->info()].z_cv, delaunay_color, 1);
-
 		//Add the face of the linked 3d points of this 2d triangle:
 		triangles_list_3d.push_back(Triangle(XYZs[1][face->vertex(0)->info()], XYZs[1][face->vertex(1)->info()], XYZs[1][face->vertex(2)->info()])); //XYZs[1] == close
 	}
@@ -218,3 +258,27 @@ void EKFOA::process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & rW,
 
 //	std::cout << "tracker = " << time_tracker/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
 }
+
+#ifndef EKFOA_HEADLESS
+/*
+ * draw:
+ * Debug overlay of the last processed frame (process does not draw on it): the tracked features and the Delaunay triangulation
+ * of the surface. Not needed by the filter, so it is left out of headless builds (EKFOA_HEADLESS).
+ */
+void EKFOA::draw(cv::Mat & frame, const Delaunay & triangulation) const{
+	motion_tracker.draw(frame);
+
+	cv::Scalar delaunay_color = cv::Scalar(255, 0, 0); //blue
+	for(Delaunay::Finite_faces_iterator fit = triangulation.finite_faces_begin(); fit != triangulation.finite_faces_end(); ++fit) {
+		//The vertices are the image positions of the features:
+		cv::Point2f uv[3];
+		for (int i=0 ; i<3 ; i++){
+			const Point2d & vertex = fit->vertex(i)->point();
+			uv[i] = cv::Point2f(CGAL::to_double(vertex.x()), CGAL::to_double(vertex.y()));
+		}
+		line(frame, uv[0], uv[1], delaunay_color, 1);
+		line(frame, uv[1], uv[2], delaunay_color, 1);
+		line(frame, uv[2], uv[0], delaunay_color, 1);
+	}
+}
+#endif
@@ -14,6 +14,7 @@
 #include <pwd.h> //getpwuid
 
 #include "camera.hpp"
+#include "image_rectifier.hpp"
 #include "kalman.hpp"
 #include "motion_tracker_of.hpp"
 
@@ -42,10 +43,23 @@ typedef CGAL::AABB_triangle_primitive<K_surface, Iterator> Primitive;
 typedef CGAL::AABB_traits<K_surface, Primitive> AABB_triangle_traits;
 typedef CGAL::AABB_tree<AABB_triangle_traits> Tree;
 
+/*
+ * EKFOA_TRACKED_FEATURES: features the tracker keeps in the image, and the limit of features in the filter state. The tracker only
+ * tops up to it, so the filter only refuses new features if its state ever holds more than the tracker does.
+ * A build with EKFOA_MAX_FEATURES needs room for them.
+ */
+#define EKFOA_TRACKED_FEATURES 30
+#if defined(EKFOA_MAX_FEATURES) && EKFOA_MAX_FEATURES < EKFOA_TRACKED_FEATURES
+#error "EKFOA_MAX_FEATURES has no room for the features the tracker keeps (EKFOA_TRACKED_FEATURES)"
+#endif
 
 class EKFOA {
 private:
 	Camera cam;
+#ifdef EKFOA_RECTIFY_INPUT
+	ImageRectifier rectifier; //the frames are rectified, cam is a pinhole camera
+#endif
+	FeatureEvictionFlightPath eviction_policy;
 	Kalman filter;
 	cv::Mat frame;
 	MotionTrackerOF motion_tracker;
@@ -54,6 +68,10 @@ public:
 	EKFOA();
 	void process(const double delta_t, cv::Mat & frame, Eigen::Vector3d & position, Eigen::Vector4d & orientation, Eigen::Matrix3d & axes_orientation_and_confidence, std::vector<Point3d> (& XYZs)[3], Delaunay & triangulation, Point3d & closest_point);
 	const Kalman & kalman_filter() const { return filter; }
+	const MotionTrackerOF & tracker() const { return motion_tracker; }
+#ifndef EKFOA_HEADLESS
+	void draw(cv::Mat & frame, const Delaunay & triangulation) const;
+#endif
 };
 
 #endif
@@ -6,18 +6,18 @@
  * Using the predicted state of the feature (yi), compute 'h'. Where 'h' is the state interpretation in image coordinates.
  * Basically it projects the predicted 3D point into the image.
  */
-bool Feature::compute_h(const Camera & cam, const Eigen::Vector3d & rW, const Eigen::Matrix3d & qWR_rotation_matrix, const Eigen::VectorXd & yi, Eigen::Vector2d & hi){
+bool Feature::compute_h(const Camera & cam, const Vector3s & rW, const Matrix3s & qWR_rotation_matrix, const Eigen::Ref<const VectorXs> & yi, Vector2s & hi){
 	//TODO: provide a better integration of the tracking algorithm. 'h' can be used to significantly reduce the search space of the tracker:
 
 	//cartesian point (p_from_cam_perspective = [x y z]'), with the current camera position/orientation as the origin of the cartesian coord system.
-	Eigen::Vector3d p_from_cam_perspective;
+	Vector3s p_from_cam_perspective;
 	p_from_cam_perspective = qWR_rotation_matrix.transpose() * Feature::compute_unrotated_hc(rW, yi);
 
 	//project p into the undistorted projection plane:
-	Eigen::Vector2d uvu;
+	Vector2s uvu;
 	cam.project_p_to_uvu(p_from_cam_perspective, uvu);
 
-	Eigen::Vector2d uvd;
+	Vector2s uvd;
 	cam.distort(uvu, uvd);
 
 	hi = uvd;
@@ -30,109 +30,260 @@ bool Feature::compute_h(const Camera & cam, const Eigen::Vector3d & rW, const Ei
  * compute_cartesian:
  * Returns the cartesian point coordinate (p = [x y z]') with the world origin as the cartesian coord system
  */
-Eigen::Vector3d Feature::compute_cartesian(const Eigen::VectorXd & yi){
-	//TODO: Asserts
+Vector3s Feature::compute_cartesian(const Eigen::Ref<const VectorXs> & yi){
+	if (yi.rows() == CARTESIAN_SIZE)
+		return yi;
 
-	const Eigen::VectorXd & yi_rW = yi.head(3); //camera position when it was first seen.
-	double theta = yi(3);
-	double phi = yi(4);
-	double rho = yi(5);
+	const Vector3s yi_rW = yi.head<3>(); //camera position when it was first seen.
 
-	Eigen::Vector3d mi;
-	Feature::compute_m(theta, phi, mi);
+	Vector3s mi;
+	ekf_scalar rho = Feature::compute_ray(yi, mi);
 
 	return yi_rW + (1/rho)*mi;
 }
 
-Eigen::Vector3d Feature::compute_unrotated_hc(const Eigen::Vector3d & rW, const Eigen::VectorXd & yi){
+Vector3s Feature::compute_unrotated_hc(const Vector3s & rW, const Eigen::Ref<const VectorXs> & yi){
+	if (yi.rows() == CARTESIAN_SIZE)
+		return yi - rW;
 
-	const Eigen::Vector3d & yi_rW = yi.head<3>(); //camera orientation when it was first seen.
-	double theta = yi(3);
-	double phi = yi(4);
-	double rho = yi(5);
+	const Vector3s & yi_rW = yi.head<3>(); //camera orientation when it was first seen.
 
-	Eigen::Vector3d mi;
-	Feature::compute_m(theta, phi, mi);
+	Vector3s mi;
+	ekf_scalar rho = Feature::compute_ray(yi, mi);
 
 	return ((yi_rW - rW)*rho + mi);
 }
 
+void FeatureProjections::resize(const int num_features){
+	FeaturesArray * lanes[] = {&anchor_x, &anchor_y, &anchor_z, &m_x, &m_y, &m_z, &theta, &phi, &rho,
+			&sin_theta, &cos_theta, &sin_phi, &cos_phi, &hrl_x, &hrl_y, &hrl_z, &hc_x, &hc_y, &hc_z, &u, &v};
+	for (size_t i=0 ; i<sizeof(lanes)/sizeof(lanes[0]) ; i++){
+		lanes[i]->resize(num_features);
+	}
+	has_angles.resize(num_features);
+}
+
+/*
+ * set_lane:
+ * Unpacks the feature state yi (inverse depth, anchored homogeneous or Cartesian) into the input lanes of a FeatureProjections entry.
+ */
+void Feature::set_lane(const Eigen::Ref<const VectorXs> & yi, FeatureProjections & projections, const int lane){
+	projections.anchor_x(lane) = yi(0);
+	projections.anchor_y(lane) = yi(1);
+	projections.anchor_z(lane) = yi(2);
+	projections.m_x(lane) = projections.m_y(lane) = projections.m_z(lane) = 0;
+	projections.theta(lane) = projections.phi(lane) = 0;
+	projections.has_angles(lane) = 0;
+	projections.rho(lane) = 1;
+
+	if (yi.rows() == HOMOGENEOUS_SIZE){
+		projections.m_x(lane) = yi(3);
+		projections.m_y(lane) = yi(4);
+		projections.m_z(lane) = yi(5);
+		projections.rho(lane) = yi(6);
+	} else if (yi.rows() == INVERSE_DEPTH_SIZE){
+		projections.theta(lane) = yi(3);
+		projections.phi(lane) = yi(4);
+		projections.has_angles(lane) = 1;
+		projections.rho(lane) = yi(5);
+	}
+}
+
+/*
+ * project:
+ * compute_h for a batch of features: their predicted image position (u, v) and the intermediate results compute_H needs.
+ * Every step is an array expression over all the features (no branches). Only the inverse depth features need the sine and cosine of
+ * their angles, they are gathered so that those are computed over them alone (none with the anchored homogeneous features).
+ */
+void Feature::project(const Camera & cam, const Vector3s & rW, const Matrix3s & qWR_rotation_matrix, FeatureProjections & projections){
+	FeatureProjections & b = projections;
+
+	const int num_angles = b.has_angles.sum();
+	if (num_angles > 0){
+		FeaturesArrayi angle_lanes(num_angles);
+		FeaturesArray theta(num_angles), phi(num_angles);
+		for (int lane=0, k=0 ; k<num_angles ; lane++){
+			if (b.has_angles(lane)){
+				angle_lanes(k) = lane;
+				theta(k) = b.theta(lane);
+				phi(k) = b.phi(lane);
+				k++;
+			}
+		}
+
+		const FeaturesArray sin_theta = theta.sin();
+		const FeaturesArray cos_theta = theta.cos();
+		const FeaturesArray sin_phi = phi.sin();
+		const FeaturesArray cos_phi = phi.cos();
+
+		//m = (cos(phi)*sin(theta), -sin(phi), cos(phi)*cos(theta)):
+		for (int k=0 ; k<num_angles ; k++){
+			const int lane = angle_lanes(k);
+			b.sin_theta(lane) = sin_theta(k);
+			b.cos_theta(lane) = cos_theta(k);
+			b.sin_phi(lane) = sin_phi(k);
+			b.cos_phi(lane) = cos_phi(k);
+			b.m_x(lane) = cos_phi(k)*sin_theta(k);
+			b.m_y(lane) = -sin_phi(k);
+			b.m_z(lane) = cos_phi(k)*cos_theta(k);
+		}
+	}
+
+	//hrl = (anchor - rW)*rho + m:
+	b.hrl_x = (b.anchor_x - rW(0))*b.rho + b.m_x;
+	b.hrl_y = (b.anchor_y - rW(1))*b.rho + b.m_y;
+	b.hrl_z = (b.anchor_z - rW(2))*b.rho + b.m_z;
+
+	//hc = R'*hrl:
+	const Matrix3s & R = qWR_rotation_matrix;
+	b.hc_x = R(0, 0)*b.hrl_x + R(1, 0)*b.hrl_y + R(2, 0)*b.hrl_z;
+	b.hc_y = R(0, 1)*b.hrl_x + R(1, 1)*b.hrl_y + R(2, 1)*b.hrl_z;
+	b.hc_z = R(0, 2)*b.hrl_x + R(1, 2)*b.hrl_y + R(2, 2)*b.hrl_z;
+
+	cam.project_p_to_uvd(b.hc_x, b.hc_y, b.hc_z, b.u, b.v);
+}
+
 /*
  * compute_H:
- * Computes the derivative of the function h with respect to x, a Jacobian of dh/dx = H.
+ * Computes the derivative of the function h with respect to x, a Jacobian of dh/dx = H, for the feature yi projected at the given
+ * lane of projections (Feature::project). H is zero everywhere except at the camera state (Hi_xv, first 13 columns) and at the
+ * feature state (Hi_yi, a column per value of yi, the rest are not used).
+ * Returns whether the feature is valid: Cartesian points always are, inverse depth ones if their inverse depth is positive (H is
+ * not computed otherwise).
  */
-void Feature::compute_H(const Camera & cam, const Eigen::Vector3d & rW, const Eigen::Vector4d & qWR, const Eigen::Matrix3d & qWR_rotation_matrix, const Eigen::VectorXd & x_k_k, const Eigen::VectorXd & yi, const int yi_start_pos, const Eigen::Vector2d & hi, Eigen::MatrixXd & Hi){
+bool Feature::compute_H(const Camera & cam, const Vector3s & rW, const Vector4s & qWR, const Matrix3s & qWR_rotation_matrix, const Eigen::Ref<const VectorXs> & yi, const FeatureProjections & projections, const int lane, Eigen::Matrix<ekf_scalar, 2, 13> & Hi_xv, Eigen::Matrix<ekf_scalar, 2, 7> & Hi_yi){
+	const int yi_size = yi.rows();
+	const ekf_scalar rho = projections.rho(lane);
 
-	Eigen::Matrix3d qWR_rotation_matrix_inverse = qWR_rotation_matrix.inverse();
+	if (yi_size != CARTESIAN_SIZE && rho <= 0)
+		return false;
 
-	//Initialize the Jacobian 'H' column for this feature:
-	Hi.setZero(2, x_k_k.size());
+	const Matrix3s qWR_rotation_matrix_inverse = qWR_rotation_matrix.transpose(); //it is a rotation
+	const Vector2s hi(projections.u(lane), projections.v(lane));
+	const Vector3s hrl(projections.hrl_x(lane), projections.hrl_y(lane), projections.hrl_z(lane));
+	const Vector3s hc(projections.hc_x(lane), projections.hc_y(lane), projections.hc_z(lane));
 
 	/*
-	 * Set the derivative of this feature against the camera position:
+	 * dh_dhrl: predicted state in image coordinates(hi) against hrl
 	 */
-	//dh_drw: predicted state in image coordinates(hi) against position (rW)
-	Eigen::Matrix2d dhd_dhu;
+	Matrix2s dhd_dhu;
 	cam.jacob_undistort(hi, dhd_dhu);
 	dhd_dhu = dhd_dhu.inverse().eval();
 
-	Eigen::Matrix<double, 2, 3>  dhu_dhrl;
+	Eigen::Matrix<ekf_scalar, 2, 3> dhu_dhc;
+	cam.jacob_project_p_to_uvu(hc, dhu_dhc);
 
-	Eigen::Vector3d hc; //Cartesian point from current camera perspective. hc = [x y z]', cartesian coord system origin is current camera position (rW, qWR)
-	hc = qWR_rotation_matrix.inverse() * Feature::compute_unrotated_hc(rW, yi);
+	const Eigen::Matrix<ekf_scalar, 2, 3> dh_dhc = dhd_dhu*dhu_dhc;
+	const Eigen::Matrix<ekf_scalar, 2, 3> dh_dhrl = dh_dhc*qWR_rotation_matrix_inverse;
 
-	cam.jacob_project_p_to_uvu(hc, dhu_dhrl);
+	/*
+	 * Set the derivative of this feature against the camera position and orientation (the velocities do not take part in the projection):
+	 */
+	Hi_xv.setZero();
+	Hi_xv.block<2, 3>(0, 0) = -rho*dh_dhrl; //dh_drw
 
-	Eigen::Matrix3d dhrl_drw = - qWR_rotation_matrix_inverse * yi(5);
+	//dh_dqwr: hc = R(qbar)*hrl, with qbar the conjugate of qWR
+	Eigen::Matrix<ekf_scalar, 3, 4> dRq_times_a_by_dq;
+	Vector4s qbar;
+	MotionModel::qconj(qWR, qbar);
+	MotionModel::dposw_dq(hrl, qbar, dRq_times_a_by_dq);
+	Eigen::Matrix<ekf_scalar, 2, 4> dh_dqbar = dh_dhc*dRq_times_a_by_dq;
+	Hi_xv.block<2, 1>(0, 3) = dh_dqbar.col(0); //dqbar_by_dq = diag(1, -1, -1, -1)
+	Hi_xv.block<2, 3>(0, 4) = -dh_dqbar.rightCols<3>();
 
-	Eigen::Matrix<double, 2, 3> dh_dhrl = dhd_dhu*dhu_dhrl;
+	/*
+	 * Set dh_dy: predicted state in image coordinates(hi) against feature state (yi)
+	 */
+	if (yi_size == CARTESIAN_SIZE){
+		Hi_yi.leftCols<3>() = dh_dhrl; //dhrl_dy = I
+		Hi_yi.rightCols<4>().setZero();
+	} else if (yi_size == HOMOGENEOUS_SIZE){
+		//dhrl_dy = [rho*I  I  yi_rW - rW], products and sums only:
+		Hi_yi.leftCols<3>() = rho*dh_dhrl;
+		Hi_yi.block<2, 3>(0, 3) = dh_dhrl;
+		Hi_yi.col(6) = dh_dhrl*(yi.head<3>() - rW);
+	} else {
+		//dhrl_dy = [rho*I  dm_dtheta  dm_dphi  yi_rW - rW], with the sines and cosines of the projection:
+		const ekf_scalar sin_theta = projections.sin_theta(lane);
+		const ekf_scalar cos_theta = projections.cos_theta(lane);
+		const ekf_scalar sin_phi = projections.sin_phi(lane);
+		const ekf_scalar cos_phi = projections.cos_phi(lane);
+
+		Hi_yi.leftCols<3>() = rho*dh_dhrl;
+		Hi_yi.col(3) = dh_dhrl*Vector3s(cos_phi*cos_theta, 0, -cos_phi*sin_theta);
+		Hi_yi.col(4) = dh_dhrl*Vector3s(-sin_phi*sin_theta, -cos_phi, -sin_phi*cos_theta);
+		Hi_yi.col(5) = dh_dhrl*(yi.head<3>() - rW);
+		Hi_yi.col(6).setZero();
+	}
 
-	Hi.block<2, 3>(0, 0) = dh_dhrl * dhrl_drw; //dh_drw
+	return true;
+}
 
-	//dh_dqwr: predicted state in image coordinates(hi) against orientation (qWR)
-	Eigen::Matrix<double, 3, 4> dhrl_dqwr;
-	Eigen::Matrix<double, 3, 4> dRq_times_a_by_dq;
-	Eigen::Vector4d qbar;
-	MotionModel::qconj(qWR, qbar);
-	MotionModel::dposw_dq(Feature::compute_unrotated_hc(rW, yi), qbar, dRq_times_a_by_dq);
-	Eigen::Matrix4d dqbar_by_dq = Eigen::Vector4d(1,-1,-1,-1).asDiagonal();
+/*
+ * compute_linearity_index:
+ * Linearity index of the inverse depth feature yi seen from rW, as Civera et al. "Inverse Depth Parametrization for Monocular SLAM" (2008):
+ *   L = 4*sigma_d/d1*|cos(alpha)|
+ * with sigma_d = sigma_rho/rho^2 the depth standard deviation, d1 the distance from the camera to the point and alpha the angle
+ * between the anchor ray (m) and the ray from the camera. When it is small (around 0.1) the Cartesian representation is as linear.
+ * (For an anchored homogeneous point m is not unit, the depth is |m|/rho.)
+ */
+ekf_scalar Feature::compute_linearity_index(const Vector3s & rW, const Eigen::Ref<const VectorXs> & yi, const ekf_scalar sigma_rho){
+	Vector3s mi;
+	const ekf_scalar rho = Feature::compute_ray(yi, mi);
+	const ekf_scalar m_norm = mi.norm();
 
-	dhrl_dqwr = dRq_times_a_by_dq * dqbar_by_dq;
+	const Vector3s hc = yi.head<3>() + (1/rho)*mi - rW;
+	const ekf_scalar d1 = hc.norm();
+	const ekf_scalar cos_alpha = mi.dot(hc)/(m_norm*d1);
 
-	Hi.block<2, 4>(0, 3) = dh_dhrl * dhrl_dqwr; //dh_dqwr
+	return 4*(m_norm*sigma_rho/(rho*rho))/d1*std::abs(cos_alpha);
+}
 
+/*
+ * compute_cartesian_jacobian:
+ * Derivative of the Cartesian point (compute_cartesian) against the inverse depth feature yi (only its first yi.rows() columns are set):
+ *   dp_dy = [I  dm_dtheta/rho  dm_dphi/rho  -m/rho^2] for inverse depth features
+ *   dp_dy = [I  I/rho  -m/rho^2] for anchored homogeneous points
+ */
+void Feature::compute_cartesian_jacobian(const Eigen::Ref<const VectorXs> & yi, Eigen::Matrix<ekf_scalar, 3, 7> & dp_dy){
+	if (yi.rows() == HOMOGENEOUS_SIZE){
+		const ekf_scalar rho = yi(6);
 
-	/*
-	 * Set dh_dy: predicted state in image coordinates(hi) against feature state (yi)
-	 */
-	//dhrl_dy:
-	Eigen::Matrix<double, 3, 6> dhrl_dy;
-	Feature::compute_dhrl_dy(rW, qWR_rotation_matrix_inverse, yi, dhrl_dy);
+		dp_dy.block<3, 3>(0, 0).setIdentity();
+		dp_dy.block<3, 3>(0, 3) = Matrix3s::Identity()/rho;
+		dp_dy.col(6) = -yi.segment<3>(3)/(rho*rho);
+		return;
+	}
+
+	const ekf_scalar theta = yi(3);
+	const ekf_scalar phi = yi(4);
+	const ekf_scalar rho = yi(5);
+
+	Vector3s mi;
+	Feature::compute_m(theta, phi, mi);
 
-	Hi.block<2, 6>(0, yi_start_pos) = dh_dhrl * dhrl_dy; //dh_dy
+	dp_dy.block<3, 3>(0, 0).setIdentity();
+	dp_dy.block<3, 1>(0, 3) = Vector3s(cos(phi)*cos(theta), 0, -cos(phi)*sin(theta))/rho;
+	dp_dy.block<3, 1>(0, 4) = Vector3s(-sin(phi)*sin(theta), -cos(phi), -sin(phi)*cos(theta))/rho;
+	dp_dy.block<3, 1>(0, 5) = -mi/(rho*rho);
 }
 
 
 //compute the ray directional vector
-void Feature::compute_m( const double theta, const double phi, Eigen::Vector3d & mi ){
-    double cphi = cos(phi);
+void Feature::compute_m( const ekf_scalar theta, const ekf_scalar phi, Vector3s & mi ){
+    ekf_scalar cphi = cos(phi);
     mi(0) = cphi*sin(theta);
     mi(1) = -sin(phi);
 	mi(2) = cphi*cos(theta);
 }
 
-void Feature::compute_dhrl_dy(const Eigen::Vector3d & rW, const Eigen::Matrix3d & qWR_rotation_matrix_inverse, const Eigen::VectorXd & yi, Eigen::Matrix<double, 3, 6> & dhrl_dy){
-    double theta = yi(3);
-    double phi = yi(4);
-    double lambda = yi(5);
-
-    Eigen::Vector3d dmi_dthetai = qWR_rotation_matrix_inverse * Eigen::Vector3d(cos(phi)*cos(theta), 0, -cos(phi)*sin(theta));
+//the ray directional vector (mi) and the inverse depth (returned) of an inverse depth or anchored homogeneous feature
+ekf_scalar Feature::compute_ray( const Eigen::Ref<const VectorXs> & yi, Vector3s & mi ){
+	if (yi.rows() == HOMOGENEOUS_SIZE){
+		mi = yi.segment<3>(3);
+		return yi(6);
+	}
 
-    Eigen::Vector3d dmi_dphii = qWR_rotation_matrix_inverse * Eigen::Vector3d(-sin(phi)*sin(theta), -cos(phi), -sin(phi)*cos(theta));
-
-    dhrl_dy.block<3, 3>(0, 0) = lambda*qWR_rotation_matrix_inverse;
-    dhrl_dy.block<3, 1>(0, 3) = dmi_dthetai;
-    dhrl_dy.block<3, 1>(0, 4) = dmi_dphii;
-    dhrl_dy.block<3, 1>(0, 5) = qWR_rotation_matrix_inverse*(yi.segment<3>(0)-rW);
+	Feature::compute_m(yi(3), yi(4), mi);
+	return yi(5);
 }
-
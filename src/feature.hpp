@@ -8,16 +8,69 @@
 #include <Eigen/Core>  //Derived
 #include <Eigen/Eigen> //math/quaternion
 
+/*
+ * FeatureProjections:
+ * A batch of features as a structure of arrays (an entry per feature in each array), so that their projection (Feature::project)
+ * runs with Eigen array expressions, vectorized over the features (SSE/AVX, or NEON in single precision). The caller sets the
+ * input lanes of each feature (Feature::set_lane), the rest are computed by Feature::project.
+ */
+struct FeatureProjections {
+	//Inputs, the point from the camera is hrl = (anchor - rW)*rho + m:
+	FeaturesArray anchor_x, anchor_y, anchor_z; //the anchor, or the point itself for Cartesian features
+	FeaturesArray m_x, m_y, m_z; //the ray direction of anchored homogeneous features (0 for the rest, project sets it for inverse depth ones)
+	FeaturesArray theta, phi; //inverse depth features get their ray from their azimuth and elevation
+	FeaturesArrayi has_angles; //1 for inverse depth features
+	FeaturesArray rho; //1 for Cartesian features
+
+	//Outputs:
+	FeaturesArray sin_theta, cos_theta, sin_phi, cos_phi; //only set for inverse depth features
+	FeaturesArray hrl_x, hrl_y, hrl_z; //the point from the camera position, in world orientation
+	FeaturesArray hc_x, hc_y, hc_z; //the point from the camera
+	FeaturesArray u, v; //h, in distorted image coordinates
+
+	void resize(const int num_features);
+};
+
+/*
+ * A feature state (yi) is either an inverse depth point (6 values: anchor camera position xyz, theta, phi, rho), an anchored
+ * homogeneous point (7 values: anchor camera position xyz, ray direction m in world coordinates, rho) or, once its depth has
+ * converged, a Cartesian point (3 values: xyz). The size of yi tells which one it is.
+ * Both inverse depth points are p = anchor + m/rho, but the homogeneous one stores m itself instead of its azimuth and elevation,
+ * so it is projected (and derived) without any trigonometric function.
+ */
 class Feature {
+public:
+	enum {
+		INVERSE_DEPTH_SIZE = 6,
+		HOMOGENEOUS_SIZE = 7,
+		CARTESIAN_SIZE = 3
+	};
+
+	//A yi that is built rather than referenced in the state (anchor in front), it is never bigger than a homogeneous point so it does not allocate:
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 1, Eigen::ColMajor, HOMOGENEOUS_SIZE, 1> StateVector;
+
+	//How a feature is stored in the filter state. An anchored feature only stores its own values ((theta, phi, rho) or (m, rho)), its
+	//anchor is shared with the features first seen in the same frame; its yi still has the anchor in front of them.
+	enum Parametrization {
+		INVERSE_DEPTH,
+		ANCHORED_INVERSE_DEPTH,
+		ANCHORED_HOMOGENEOUS,
+		CARTESIAN
+	};
+
 private:
-	static void compute_m( const double theta, const double phi, Eigen::Vector3d & mi );
-	static void compute_dhrl_dy(const Eigen::Vector3d & rW, const Eigen::Matrix3d & qWR_rotation_matrix_inverse, const Eigen::VectorXd & yi, Eigen::Matrix<double, 3, 6> & dhrl_dy);
+	static void compute_m( const ekf_scalar theta, const ekf_scalar phi, Vector3s & mi );
+	static ekf_scalar compute_ray( const Eigen::Ref<const VectorXs> & yi, Vector3s & mi );
 
 public:
-	static Eigen::Vector3d compute_unrotated_hc( const Eigen::Vector3d & rW, const Eigen::VectorXd & yi);
-	static Eigen::Vector3d compute_cartesian( const Eigen::VectorXd & yi);
-	static bool compute_h( const Camera & cam, const Eigen::Vector3d & rW, const Eigen::Matrix3d & qWR_rotation_matrix, const Eigen::VectorXd & yi, Eigen::Vector2d & hi );
-	static void compute_H( const Camera & cam, const Eigen::Vector3d & rW, const Eigen::Vector4d & qWR, const Eigen::Matrix3d & qWR_rotation_matrix, const Eigen::VectorXd & x_k_k, const Eigen::VectorXd & yi, const int yi_start_pos, const Eigen::Vector2d & hi, Eigen::MatrixXd & Hi);
+	static Vector3s compute_unrotated_hc( const Vector3s & rW, const Eigen::Ref<const VectorXs> & yi);
+	static Vector3s compute_cartesian( const Eigen::Ref<const VectorXs> & yi);
+	static bool compute_h( const Camera & cam, const Vector3s & rW, const Matrix3s & qWR_rotation_matrix, const Eigen::Ref<const VectorXs> & yi, Vector2s & hi );
+	static void set_lane( const Eigen::Ref<const VectorXs> & yi, FeatureProjections & projections, const int lane );
+	static void project( const Camera & cam, const Vector3s & rW, const Matrix3s & qWR_rotation_matrix, FeatureProjections & projections );
+	static bool compute_H( const Camera & cam, const Vector3s & rW, const Vector4s & qWR, const Matrix3s & qWR_rotation_matrix, const Eigen::Ref<const VectorXs> & yi, const FeatureProjections & projections, const int lane, Eigen::Matrix<ekf_scalar, 2, 13> & Hi_xv, Eigen::Matrix<ekf_scalar, 2, 7> & Hi_yi);
+	static ekf_scalar compute_linearity_index( const Vector3s & rW, const Eigen::Ref<const VectorXs> & yi, const ekf_scalar sigma_rho );
+	static void compute_cartesian_jacobian( const Eigen::Ref<const VectorXs> & yi, Eigen::Matrix<ekf_scalar, 3, 7> & dp_dy );
 };
 
 #endif
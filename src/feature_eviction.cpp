@@ -0,0 +1,78 @@
+#include "feature_eviction.hpp"
+#include "feature.hpp" //compute_cartesian
+#include "kalman.hpp" //Features_extra, feature_state
+
+#include <limits> //infinity
+
+std::string FeatureEvictionOldest::type(){
+	return std::string("oldest");
+}
+
+void FeatureEvictionOldest::compute_relevance(const Eigen::Ref<const VectorXs> & /*x_k_k*/, const Eigen::Ref<const MatrixXs> & /*p_k_k*/, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance){
+	const int num_features = features_extra.size();
+	relevance.resize(num_features);
+	for (int i=0 ; i<num_features ; i++){
+		relevance[i] = i; //the last added features are the most relevant
+	}
+}
+
+std::string FeatureEvictionDepthUncertainty::type(){
+	return std::string("depth_uncertainty");
+}
+
+void FeatureEvictionDepthUncertainty::compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & p_k_k, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance){
+	const int num_features = features_extra.size();
+	relevance.resize(num_features);
+	const Vector3s rW = x_k_k.segment<3>(0); //current camera position
+
+	for (int i=0 ; i<num_features ; i++){
+		const int yi_start_pos = features_extra[i].yi_start_pos;
+
+		if (features_extra[i].parametrization == Feature::CARTESIAN){
+			//variance along the ray from the camera: ray' * P(p, p) * ray
+			const Vector3s ray = (x_k_k.segment<3>(yi_start_pos) - rW).normalized();
+			relevance[i] = -std::sqrt(ray.dot(p_k_k.block<3, 3>(yi_start_pos, yi_start_pos)*ray));
+			continue;
+		}
+
+		const int rho_index = yi_start_pos + features_extra[i].yi_size - 1; //the last value of an inverse depth feature
+		const ekf_scalar rho = x_k_k(rho_index);
+
+		if (rho > 0){
+			//depth = 1/rho, so its standard deviation is (to first order) sigma_rho/rho^2:
+			relevance[i] = -std::sqrt(p_k_k(rho_index, rho_index))/(rho*rho);
+		} else {
+			//behind the camera, its depth is unknown:
+			relevance[i] = -std::numeric_limits<ekf_scalar>::infinity();
+		}
+	}
+}
+
+std::string FeatureEvictionFlightPath::type(){
+	return std::string("flight_path");
+}
+
+void FeatureEvictionFlightPath::compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & /*p_k_k*/, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance){
+	const int num_features = features_extra.size();
+	relevance.resize(num_features);
+
+	const Vector3s rW = x_k_k.segment<3>(0); //current camera position
+	Vector3s direction = x_k_k.segment<3>(7); //current camera velocity
+	const ekf_scalar speed = direction.norm();
+	if (speed > 0){
+		direction /= speed;
+	}
+
+	for (int i=0 ; i<num_features ; i++){
+		const Feature::StateVector yi = Kalman::feature_state(x_k_k, features_extra[i]);
+		const Vector3s rW_to_feature = Feature::compute_cartesian(yi) - rW;
+
+		//Distance to the flight path ray, or to the camera if the feature is behind it (or the camera is not moving):
+		const ekf_scalar along_path = rW_to_feature.dot(direction);
+		if (speed > 0 && along_path > 0){
+			relevance[i] = -(rW_to_feature - along_path*direction).norm();
+		} else {
+			relevance[i] = -rW_to_feature.norm();
+		}
+	}
+}
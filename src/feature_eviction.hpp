@@ -0,0 +1,59 @@
+#ifndef FEATURE_EVICTION_H_
+#define FEATURE_EVICTION_H_
+
+#include <string> //string
+#include <vector> //vector
+
+#include <Eigen/Dense> //Ref
+
+#include "scalar.hpp" //ekf_scalar
+
+struct Features_extra;
+
+/*
+ * FeatureEvictionPolicy interface:
+ * Chooses the features to be removed from the filter when it holds more than its maximum number of features.
+ * Removing a feature rows and columns from the state and covariance matrix marginalises it out of the estimation.
+ *
+ * compute_relevance gives a value per feature of the state (features_extra, in state order), the least relevant ones are evicted first.
+ */
+class FeatureEvictionPolicy {
+public:
+	virtual std::string type() = 0;
+
+	virtual void compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & p_k_k, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance) = 0;
+
+	virtual ~FeatureEvictionPolicy(){}
+};
+
+/*
+ * Evicts the features that have been in the state for longer. New features are added at the end of the state and deleting
+ * features keeps the order, so the oldest ones are the first.
+ */
+class FeatureEvictionOldest: public FeatureEvictionPolicy {
+public:
+	std::string type();
+	void compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & p_k_k, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance);
+};
+
+/*
+ * Evicts the features whose depth is less known (largest depth standard deviation: sigma_rho/rho^2 for inverse depth features,
+ * the standard deviation along the ray from the camera for Cartesian ones).
+ */
+class FeatureEvictionDepthUncertainty: public FeatureEvictionPolicy {
+public:
+	std::string type();
+	void compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & p_k_k, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance);
+};
+
+/*
+ * Evicts the features farthest from the flight path (the ray from the camera position along its velocity), which are the
+ * least relevant to avoid obstacles.
+ */
+class FeatureEvictionFlightPath: public FeatureEvictionPolicy {
+public:
+	std::string type();
+	void compute_relevance(const Eigen::Ref<const VectorXs> & x_k_k, const Eigen::Ref<const MatrixXs> & p_k_k, const std::vector<Features_extra> & features_extra, std::vector<ekf_scalar> & relevance);
+};
+
+#endif
@@ -0,0 +1,41 @@
+#include "image_rectifier.hpp"
+
+const cv::Mat & ImageRectifier::rectify(const cv::Mat & frame){
+	if (frame.size() != map_size_){
+		build_maps(frame.size());
+	}
+
+	//cv::remap does not work in place, if the input is the previous output it gets a new buffer:
+	if (frame.data == rectified_.data){
+		rectified_ = cv::Mat();
+	}
+
+	//Replicate the border, so that the areas out of the input frame do not create strong corners for the tracker:
+	cv::remap(frame, rectified_, map_1_, map_2_, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+	return rectified_;
+}
+
+/*
+ * build_maps:
+ * Distorts the position of every pixel of a rectified frame, that is where it is read from the input frame.
+ */
+void ImageRectifier::build_maps(const cv::Size & size){
+	cv::Mat map_x(size, CV_32FC1);
+	cv::Mat map_y(size, CV_32FC1);
+
+	for (int v=0 ; v<size.height ; v++){
+		float * map_x_row = map_x.ptr<float>(v);
+		float * map_y_row = map_y.ptr<float>(v);
+		for (int u=0 ; u<size.width ; u++){
+			Vector2s uvd;
+			lens_.distort(Vector2s(u, v), uvd);
+			map_x_row[u] = uvd(0);
+			map_y_row[u] = uvd(1);
+		}
+	}
+
+	//The fixed point representation makes cv::remap faster:
+	cv::convertMaps(map_x, map_y, map_1_, map_2_, CV_16SC2);
+	map_size_ = size;
+}
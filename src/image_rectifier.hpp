@@ -0,0 +1,37 @@
+#ifndef IMAGE_RECTIFIER_H_
+#define IMAGE_RECTIFIER_H_
+
+#include "camera.hpp" //RadialCamera
+
+#include <opencv2/core/core.hpp> //Mat
+#include <opencv2/imgproc/imgproc.hpp> //remap, convertMaps
+
+/*
+ * ImageRectifier:
+ * Removes the lens distortion of whole frames, so that the tracker and the filter can work with a pinhole camera (EKFOA_RECTIFY_INPUT).
+ * The rectified frame has the size and intrinsics (fx, fy, cx, cy) of the input one. Each of its pixels (uvu) is read from
+ * lens.distort(uvu) in the input frame, through cv::remap maps built on the first frame (and again if the frame size changes).
+ */
+class ImageRectifier {
+public:
+	ImageRectifier(const RadialCamera & lens) :
+		lens_(lens) {}
+
+	/*
+	 * rectify:
+	 * Returns the rectified version of frame, in the rectifier's own buffer: it stays valid until the next call, which overwrites it
+	 * (frame itself is never written, so it can be a view of a camera buffer).
+	 */
+	const cv::Mat & rectify(const cv::Mat & frame);
+
+private:
+	RadialCamera lens_; //calibration of the input frames
+
+	cv::Mat map_1_, map_2_; //fixed point cv::remap maps, for frames of map_size_
+	cv::Size map_size_;
+	cv::Mat rectified_; //output buffer, reused for every frame
+
+	void build_maps(const cv::Size & size);
+};
+
+#endif
@@ -1,10 +1,11 @@
 #include "kalman.hpp"
 
-Kalman::Kalman(double v_0, double std_v_0, double w_0, double std_w_0, double sigma_a, double sigma_alpha, double sigma_image_noise){
+Kalman::Kalman(ekf_scalar v_0, ekf_scalar std_v_0, ekf_scalar w_0, ekf_scalar std_w_0, ekf_scalar sigma_a, ekf_scalar sigma_alpha, ekf_scalar sigma_image_noise){
 
 	//Init with zeros the state vector and covariance matrice:
 	x_k_k_.setZero(13);
 	p_k_k_.setZero(13, 13);
+	state_size_ = 13;
 
 	x_k_k_ << 0, //Camera X position
 			0, //Camera Y position
@@ -20,13 +21,13 @@ Kalman::Kalman(double v_0, double std_v_0, double w_0, double std_w_0, double si
 			w_0, //Angular Velocity Y
 			w_0; //Angular Velocity Z
 
-	p_k_k_(0,0) = std::numeric_limits<double>::min();
-	p_k_k_(1,1) = std::numeric_limits<double>::min();
-	p_k_k_(2,2) = std::numeric_limits<double>::min();
-	p_k_k_(3,3) = std::numeric_limits<double>::min();
-	p_k_k_(4,4) = std::numeric_limits<double>::min();
-	p_k_k_(5,5) = std::numeric_limits<double>::min();
-	p_k_k_(6,6) = std::numeric_limits<double>::min();
+	p_k_k_(0,0) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(1,1) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(2,2) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(3,3) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(4,4) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(5,5) = std::numeric_limits<ekf_scalar>::min();
+	p_k_k_(6,6) = std::numeric_limits<ekf_scalar>::min();
 	p_k_k_(7,7) = std_v_0*std_v_0;
 	p_k_k_(8,8) = std_v_0*std_v_0;
 	p_k_k_(9,9) = std_v_0*std_v_0;
@@ -37,302 +38,596 @@ Kalman::Kalman(double v_0, double std_v_0, double w_0, double std_w_0, double si
 	std_a_ = sigma_a;
 	std_alpha_ = sigma_alpha;
 	std_z_ = sigma_image_noise;
+
+	update_mode_ = UPDATE_BATCH;
+	update_time_budget_ = -1;
+	last_update_observations_ = 0;
+
+	max_features_ = 0;
+	eviction_policy_ = NULL;
+	cartesian_linearity_threshold_ = 0;
+	new_features_parametrization_ = Feature::ANCHORED_INVERSE_DEPTH;
 }
 
 /*
  * Construct a calman filter with the given state, covariance matrix and deviations. Mainly used for testing.
  */
-Kalman::Kalman(const Eigen::VectorXd & x_k_k, const Eigen::MatrixXd & p_k_k, double sigma_a, double sigma_alpha, double sigma_image_noise){
+Kalman::Kalman(const VectorXs & x_k_k, const MatrixXs & p_k_k, ekf_scalar sigma_a, ekf_scalar sigma_alpha, ekf_scalar sigma_image_noise){
 	x_k_k_ = x_k_k;
 	p_k_k_ = p_k_k;
+	state_size_ = x_k_k.rows();
+	state_blocks_.assign((state_size_-13)/Feature::INVERSE_DEPTH_SIZE, Feature::INVERSE_DEPTH); //all of them inverse depth, each one with its own anchor
 
 	std_a_ = sigma_a;
 	std_alpha_ = sigma_alpha;
 	std_z_ = sigma_image_noise;
+
+	update_mode_ = UPDATE_BATCH;
+	update_time_budget_ = -1;
+	last_update_observations_ = 0;
+
+	max_features_ = 0;
+	eviction_policy_ = NULL;
+	cartesian_linearity_threshold_ = 0;
+	new_features_parametrization_ = Feature::ANCHORED_INVERSE_DEPTH;
+}
+
+/*
+ * reserve_features:
+ * Makes room for max_features in the state and covariance matrix, so that adding features up to that number does not reallocate them.
+ */
+void Kalman::reserve_features(const int max_features){
+	reserve_state(13 + max_features*Feature::HOMOGENEOUS_SIZE); //at most an anchor and 4 values per feature
+}
+
+void Kalman::reserve_state(const int size){
+	if (x_k_k_.rows() >= size)
+		return;
+
+#ifdef EKFOA_MAX_FEATURES
+	assert(size <= EKFOA_MAX_STATE_SIZE); //the filter would need more than EKFOA_MAX_FEATURES features
+#endif
+
+	//The live state and covariance are the head/top left corner of the storage, which conservativeResize keeps:
+	x_k_k_.conservativeResize(size);
+	p_k_k_.conservativeResize(size, size);
 }
 
+/*
+ * delete_features:
+ * Removes the features marked as not valid from features_extra, the state and the covariance matrix (and the anchors left without features).
+ * The surviving features are computed once and gathered in a single pass, in place. The freed slots at the end
+ * of the storage are kept for the next features to be added.
+ */
 void Kalman::delete_features(std::vector<Features_extra> & features_extra){
 
-	std::vector<size_t> delete_list;
+	//Compact features_extra, and mark the blocks of the deleted features:
+	std::vector<int> new_blocks(state_blocks_);
 
-	//TODO: have the cleanup of features_extra here as well
-	for (size_t i=0 ; i<features_extra.size() ; i++){
-		if (features_extra[i].is_valid == false){
-			delete_list.push_back(i);
+	size_t survivors = 0;
+	size_t i = 0; //feature counter
+	for (size_t b=0 ; b<state_blocks_.size() ; b++){
+		if (state_blocks_[b] == ANCHOR_BLOCK)
+			continue;
+
+		if (features_extra[i].is_valid){
+			if (survivors != i){
+				features_extra[survivors] = features_extra[i];
+			}
+			survivors++;
+		} else {
+			new_blocks[b] = REMOVED_BLOCK;
 		}
+		i++;
 	}
 
-	if (delete_list.size()==0)
+	if (survivors == features_extra.size())
 		return;
 
-	features_extra.erase(std::remove_if(features_extra.begin(), features_extra.end(), Kalman::is_feature_valid), features_extra.end());
+	features_extra.resize(survivors);
+
+	reshape_state(new_blocks);
+}
+
+int Kalman::block_size(const int block){
+	switch (block){
+	case Feature::INVERSE_DEPTH:
+		return Feature::INVERSE_DEPTH_SIZE;
+	case Feature::ANCHORED_HOMOGENEOUS:
+		return 4;
+	case Feature::ANCHORED_INVERSE_DEPTH:
+	case Feature::CARTESIAN:
+	case ANCHOR_BLOCK:
+		return 3;
+	default: //REMOVED_BLOCK
+		return 0;
+	}
+}
+
+/*
+ * reshape_state:
+ * Changes the blocks of the state to new_blocks (one per current block, REMOVED_BLOCK to remove it). A block keeps the first
+ * values of its current ones, as many as its new size. The anchors no feature refers to anymore are removed too.
+ */
+void Kalman::reshape_state(std::vector<int> & new_blocks){
+	//Anchors without features:
+	int anchor = -1;
+	std::vector<bool> anchor_used(new_blocks.size(), false);
+	for (size_t b=0 ; b<new_blocks.size() ; b++){
+		if (state_blocks_[b] == ANCHOR_BLOCK){
+			anchor = b;
+		} else if (new_blocks[b] == Feature::ANCHORED_INVERSE_DEPTH || new_blocks[b] == Feature::ANCHORED_HOMOGENEOUS){
+			anchor_used[anchor] = true;
+		}
+	}
+
+	//Where each kept value is:
+	std::vector<int> src_index;
+	for (int i=0 ; i<13 ; i++){
+		src_index.push_back(i);
+	}
+
+	int block_start_pos = 13;
+	size_t kept_blocks = 0;
+	for (size_t b=0 ; b<new_blocks.size() ; b++){
+		if (new_blocks[b] == ANCHOR_BLOCK && !anchor_used[b]){
+			new_blocks[b] = REMOVED_BLOCK;
+		}
 
-	int new_size = x_k_k_.rows();
+		for (int j=0 ; j<block_size(new_blocks[b]) ; j++){
+			src_index.push_back(block_start_pos + j);
+		}
+		block_start_pos += block_size(state_blocks_[b]);
 
-	//Start deleting from the last feature to be deleted (simplifies and optimizes the way it is done):
-	for(size_t i = delete_list.size(); i > 0; i--) {
-		unsigned int start_dst = 13 + delete_list[i-1]*6; //the feature to be delete starts at: xv_size + feature_index*6.
-		unsigned int start_src = start_dst + 6; //next feature starts at 'start_dst + 6'
-		unsigned int size_rest = x_k_k_.rows() - start_src; //relevant size minus space that does not need to change
+		if (new_blocks[b] != REMOVED_BLOCK){
+			new_blocks[kept_blocks++] = new_blocks[b];
+		}
+	}
+	new_blocks.resize(kept_blocks);
+	state_blocks_.swap(new_blocks);
 
+	if ((int)src_index.size() != state_size_){
+		gather_state(src_index);
+	}
+}
 
-		//shift rows up. Of state and covariance matrix:
-		x_k_k_.segment(start_dst, size_rest) = x_k_k_.segment(start_src, size_rest);
-		p_k_k_.block(start_dst, 0, size_rest, new_size) = p_k_k_.block(start_src, 0, size_rest, new_size);//reducing new_size before here would result in missing one column
+/*
+ * gather_state:
+ * Keeps the values src_index (in increasing order) of the state and their rows and columns of the covariance matrix, moved to
+ * the beginning of them. Values only move towards the beginning, so going forward every value is read before it is overwritten.
+ */
+void Kalman::gather_state(const std::vector<int> & src_index){
+	const int new_size = src_index.size();
 
-		//Now we can reduce the size:
-		new_size -= 6;
+	//Values before first_moved stay where they are:
+	int first_moved = 0;
+	while (first_moved < new_size && src_index[first_moved] == first_moved){
+		first_moved++;
+	}
 
-		//shift columns left. Of covariance matrix:
-		p_k_k_.block(0, start_dst, new_size, size_rest) = p_k_k_.block(0, start_src, new_size, size_rest);
+	for (int i=first_moved ; i<new_size ; i++){
+		x_k_k_(i) = x_k_k_(src_index[i]);
+	}
+
+	//Runs of consecutive kept values (start in the new state, start in the current one, length), copied as whole segments:
+	std::vector<int> run_dst, run_src, run_length;
+	for (int i=0 ; i<new_size ; i++){
+		if (i > 0 && src_index[i] == src_index[i-1] + 1){
+			run_length.back()++;
+		} else {
+			run_dst.push_back(i);
+			run_src.push_back(src_index[i]);
+			run_length.push_back(1);
+		}
+	}
 
+	//Gather the covariance matrix column by column (contiguous in memory):
+	for (int col=0 ; col<new_size ; col++){
+		if (col < first_moved){
+			//The column stays, only its rows from first_moved move up, possibly over themselves, one by one:
+			for (int row=first_moved ; row<new_size ; row++){
+				p_k_k_(row, col) = p_k_k_(src_index[row], col);
+			}
+		} else {
+			//The column comes from a later one:
+			const int col_src = src_index[col];
+			for (size_t k=0 ; k<run_dst.size() ; k++){
+				p_k_k_.col(col).segment(run_dst[k], run_length[k]) = p_k_k_.col(col_src).segment(run_src[k], run_length[k]);
+			}
+		}
 	}
 
-	x_k_k_.conservativeResize(new_size);
-	p_k_k_.conservativeResize(new_size,new_size);
+	state_size_ = new_size;
 }
 
-void Kalman::predict_state_and_covariance(const double delta_t){
+void Kalman::predict_state_and_covariance(const ekf_scalar delta_t){
 	//Return if no features are observed:
-	if (x_k_k_.rows() == 13)
+	if (state_size_ == 13)
 		return;
 
-	Eigen::MatrixXd F;
-	Eigen::MatrixXd Q;
-	MotionModel::prediction_step(delta_t, std_a_, std_alpha_, x_k_k_, F, Q);
+	Eigen::Matrix<ekf_scalar, 13, 13> F;
+	Eigen::Matrix<ekf_scalar, 13, 13> Q;
+	Eigen::Matrix<ekf_scalar, 13, 1> xv = x_k_k_.head<13>();
+	MotionModel::prediction_step(delta_t, std_a_, std_alpha_, xv, F, Q);
+	x_k_k_.head<13>() = xv;
 
 	//Update the covariance matrix as follows:
 	//  size_P_k = size(P_k,1);
 	//	p_k_k = [ F*p_k_k(1:13,1:13)*F' + Q         F*p_k_k(1:13,14:size_P_k);
 	//	          p_k_k(14:size_P_k,1:13)*F'        p_k_k(14:size_P_k,14:size_P_k)];
 
-	int size_p_k_k_minus_xv = p_k_k_.rows()-13;
-	p_k_k_.block(0, 0, 13, 13) = (F*p_k_k_.block(0, 0, 13, 13)*F.transpose() + Q).eval();
-	p_k_k_.block(0, 13, 13, size_p_k_k_minus_xv) = (F*p_k_k_.block(0, 13, 13, size_p_k_k_minus_xv)).eval();
-	p_k_k_.block(13, 0, size_p_k_k_minus_xv, 13) = (p_k_k_.block(13, 0, size_p_k_k_minus_xv, 13)*F.transpose()).eval();
+	int size_p_k_k_minus_xv = state_size_-13;
+	p_k_k_.block<13, 13>(0, 0) = (F*p_k_k_.block<13, 13>(0, 0)*F.transpose() + Q).eval();
+	p_k_k_.block<13, Eigen::Dynamic>(0, 13, 13, size_p_k_k_minus_xv) = (F*p_k_k_.block<13, Eigen::Dynamic>(0, 13, 13, size_p_k_k_minus_xv)).eval();
+	p_k_k_.block<Eigen::Dynamic, 13>(13, 0, size_p_k_k_minus_xv, 13) = p_k_k_.block<13, Eigen::Dynamic>(0, 13, 13, size_p_k_k_minus_xv).transpose(); // == p_k_k(14:end, 1:13)*F'
 }
 
-void Kalman::add_features_inverse_depth( const Camera & cam, const std::vector<cv::Point2f> & new_features_uvd_list ){
-	if (new_features_uvd_list.size() == 0)
-		return;
-
+/*
+ * add_features_inverse_depth:
+ * Adds the new features (observed at new_features_uvd_list in the current frame) to the state. With a feature limit (set_max_features)
+ * only the first ones that fit under it are added. Returns how many were added.
+ */
+int Kalman::add_features_inverse_depth( const Camera & cam, const std::vector<cv::Point2f> & new_features_uvd_list ){
 	//num new features
 	int new_features = new_features_uvd_list.size();
+	if (max_features_ > 0){
+		const int num_features = state_blocks_.size() - std::count(state_blocks_.begin(), state_blocks_.end(), (int)ANCHOR_BLOCK);
+		new_features = std::max(0, std::min(new_features, max_features_ - num_features));
+	}
+
+	if (new_features == 0)
+		return 0;
 	//Where next feature state should start:
-	int insert_point = x_k_k_.rows();
+	int insert_point = state_size_;
+
+	//All of them are first seen from the current camera position, so they share one anchor, stored before them. Then each one only
+	//needs its azimuth, elevation and inverse depth (or its ray direction and inverse depth):
+	const int own_size = block_size(new_features_parametrization_);
+	const int size_new = 3 + own_size*new_features;
 
-	//resize the state and covariance estimate:
-	x_k_k_.conservativeResize(x_k_k_.rows() + 6*new_features);
-	p_k_k_.conservativeResize(p_k_k_.rows() + 6*new_features, p_k_k_.cols() + 6*new_features);
+	//take the free slots of the state and covariance estimate (only reallocates if there are not enough):
+	reserve_state(state_size_ + size_new);
+	state_size_ += size_new;
+	state_blocks_.push_back(ANCHOR_BLOCK);
+	state_blocks_.insert(state_blocks_.end(), new_features, new_features_parametrization_);
+
+	x_k_k_.segment<3>(insert_point) = x_k_k_.head<3>();
+
+	//Extract orientation quaterion from state vector. Used to calculate the direction of the new features rays:
+	Vector4s qWR(x_k_k_(3), x_k_k_(4), x_k_k_(5), x_k_k_(6));
+
+	Matrix3s qWR_rotation_matrix;
+	MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
+
+	//Jacobians of the anchor and all the new features against the camera state (stacked) and of the features against their image observation:
+	Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 13, Eigen::ColMajor, EKFOA_MAX_NEW_FEATURES_SIZE, 13> dY_dxv(size_new, 13);
+	Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 3, Eigen::ColMajor, EKFOA_MAX_NEW_FEATURES_SIZE, 3> dY_dhd(own_size*new_features, 3);
+	dY_dxv.topRows<3>().setZero();
+	dY_dxv.block<3, 3>(0, 0).setIdentity(); //the anchor is the camera position
 
 	for (int p=0 ; p<new_features ; p++){
-		Eigen::Vector2d uvd(new_features_uvd_list[p].x, new_features_uvd_list[p].y);
-		Eigen::Vector3d xyu;
+		Vector2s uvd(new_features_uvd_list[p].x, new_features_uvd_list[p].y);
+		Vector3s xyu;
 		cam.uvd_to_homogeneous(uvd, xyu);
 
-		//Extract orientation quaterion from state vector. Used to calculate the
-		Eigen::Vector4d qWR(x_k_k_(3), x_k_k_(4), x_k_k_(5), x_k_k_(6));
+		Vector3s XYZ_w = qWR_rotation_matrix*xyu;
+
+		if (new_features_parametrization_ == Feature::ANCHORED_HOMOGENEOUS){
+			//Add point information to the state:
+			const Vector3s m = XYZ_w.normalized();
+			x_k_k_.segment<4>(insert_point + 3 + 4*p) << m, 1; //Initially guessed inverse depth, as for the inverse depth features
 
-		Eigen::Matrix3d qWR_rotation_matrix;
-		MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
+			//dm_dgw = (I - m*m')/|XYZ_w|, the derivative of the normalisation:
+			const Matrix3s dm_dgw = (Matrix3s::Identity() - m*m.transpose())/XYZ_w.norm();
+
+			Eigen::Matrix<ekf_scalar, 3, 4> dgw_dqwr;
+			MotionModel::dposw_dq(xyu, qWR, dgw_dqwr);
+
+			Eigen::Matrix<ekf_scalar, 3, 2> dgc_dhu;
+			cam.jacob_uvu_to_homogeneous(dgc_dhu);
+
+			Matrix2s dhu_dhd;
+			cam.jacob_undistort( uvd, dhu_dhd );
+
+			dY_dxv.middleRows<4>(3 + 4*p).setZero();
+			dY_dxv.block<3, 4>(3 + 4*p, 3) = dm_dgw*dgw_dqwr;
+			dY_dhd.middleRows<4>(4*p).setZero();
+			dY_dhd.block<3, 2>(4*p, 0) = dm_dgw*qWR_rotation_matrix*dgc_dhu*dhu_dhd; //dgw_dgc = qWR_rotation_matrix
+			dY_dhd(4*p + 3, 2) = 1;
+		} else {
+			//Add point information to the state:
+			add_a_feature_state_anchored_inverse_depth( XYZ_w, insert_point + 3 + 3*p );
+
+			//The first 3 rows (the anchor) are the shared ones:
+			Eigen::Matrix<ekf_scalar, 6, 13> dy_dxv;
+			Eigen::Matrix<ekf_scalar, 6, 3> dy_dhd;
+			compute_a_feature_jacobians_inverse_depth( cam, uvd, xyu, qWR, qWR_rotation_matrix, XYZ_w, dy_dxv, dy_dhd );
+			dY_dxv.middleRows<3>(3 + 3*p) = dy_dxv.bottomRows<3>();
+			dY_dhd.middleRows<3>(3*p) = dy_dhd.bottomRows<3>();
+		}
+	}
 
-		Eigen::Vector3d XYZ_w = qWR_rotation_matrix*xyu;
+	Matrix3s Padd; //TODO: std_pxl should be parametrizable
+	Padd.setIdentity(); //Initial std_pxl = 1, and std_rho = 1. Block(0,0,1,1) = I * std_pxl^2, pos(2, 2) = std_rho^2
 
-		//Add point information to the state:
-		add_a_feature_state_inverse_depth( XYZ_w, insert_point );
+	//Add the new features information to the covariance matrix, all of them at once:
+	//	P_xv = P( 1:13, 1:13 ); //Correlation of Camera with itself
+	//	P_yxv = P( 14:end, 1:13 ); //Correlation of features with camera
+	//	P_y = P( 14:end, 14:end ); //Correlation of features with features
+	//	P_xvy = P( 1:13, 14:end ); //Correlation of camera with features
+	//	p_k_k = [ P_xv          P_xvy                       P_xv*dY_dxv';
+	//	          P_yxv         P_y                         P_yxv*dY_dxv';
+	//	          dY_dxv*P_xv   dY_dxv*P_xvy                dY_dxv*P_xv*dY_dxv'+...
+	//	                                                    blkdiag(0, dy_dhd*Padd*dy_dhd')];
 
-		//Add point information to the covariance matrix:
-		add_a_feature_covariance_inverse_depth( cam, uvd, xyu, qWR, qWR_rotation_matrix, XYZ_w, insert_point );
+	//Correlation of the camera and the already existing features (pos 1 -> insert_point) with the new features, and viceversa:
+	p_k_k_.block(0, insert_point, insert_point, size_new).noalias() = p_k_k_.block<Eigen::Dynamic, 13>(0, 0, insert_point, 13)*dY_dxv.transpose(); //[P_xv ; P_yxv]*dY_dxv'
+	p_k_k_.block(insert_point, 0, size_new, insert_point) = p_k_k_.block(0, insert_point, insert_point, size_new).transpose();
 
-		insert_point += 6;
+	//Correlation between the new features:
+	p_k_k_.block(insert_point, insert_point, size_new, size_new).noalias() = dY_dxv*p_k_k_.block(0, insert_point, 13, size_new); //dY_dxv*P_xv*dY_dxv'
+	for (int p=0 ; p<new_features ; p++){
+		int start = insert_point + 3 + own_size*p;
+		p_k_k_.block(start, start, own_size, own_size).noalias() += dY_dhd.middleRows(own_size*p, own_size)*Padd*dY_dhd.middleRows(own_size*p, own_size).transpose();
 	}
+	return new_features;
 }
 
-void Kalman::add_a_feature_covariance_inverse_depth( const Camera & cam, const Eigen::Vector2d & uv_d, const Eigen::Vector3d & xy_u, const Eigen::Vector4d & qWR, const Eigen::Matrix3d & qWR_rotation_matrix , const Eigen::Vector3d & XYZ_w, const int insert_point ){
+/*
+ * compute_a_feature_jacobians_inverse_depth:
+ * Jacobians of a new inverse depth feature against the camera state (dy_dxv) and against its image observation and initial inverse depth (dy_dhd).
+ */
+void Kalman::compute_a_feature_jacobians_inverse_depth( const Camera & cam, const Vector2s & uv_d, const Vector3s & xy_u, const Vector4s & qWR, const Matrix3s & qWR_rotation_matrix , const Vector3s & XYZ_w, Eigen::Matrix<ekf_scalar, 6, 13> & dy_dxv, Eigen::Matrix<ekf_scalar, 6, 3> & dy_dhd ){
 
-	double X_w = XYZ_w(0);
-	double Y_w = XYZ_w(1);
-	double Z_w = XYZ_w(2);
+	ekf_scalar X_w = XYZ_w(0);
+	ekf_scalar Y_w = XYZ_w(1);
+	ekf_scalar Z_w = XYZ_w(2);
 
 	// Derivatives
-	Eigen::RowVector3d dtheta_dgw;
+	RowVector3s dtheta_dgw;
 	dtheta_dgw << Z_w/(X_w*X_w+Z_w*Z_w), 0, -X_w/(X_w*X_w+Z_w*Z_w);
 
-	Eigen::RowVector3d dphi_dgw;
+	RowVector3s dphi_dgw;
 	dphi_dgw << (X_w*Y_w)/((X_w*X_w+Y_w*Y_w+Z_w*Z_w)*sqrt(X_w*X_w+Z_w*Z_w)), -sqrt(X_w*X_w+Z_w*Z_w)/(X_w*X_w+Y_w*Y_w+Z_w*Z_w), (Z_w*Y_w)/((X_w*X_w+Y_w*Y_w+Z_w*Z_w)*sqrt(X_w*X_w+Z_w*Z_w));
 
-	Eigen::Matrix<double, 3, 4> dgw_dqwr;
+	Eigen::Matrix<ekf_scalar, 3, 4> dgw_dqwr;
 	MotionModel::dposw_dq(xy_u, qWR, dgw_dqwr);
 
-	Eigen::RowVector4d dtheta_dqwr = dtheta_dgw*dgw_dqwr;
-	Eigen::RowVector4d dphi_dqwr = dphi_dgw*dgw_dqwr;
+	RowVector4s dtheta_dqwr = dtheta_dgw*dgw_dqwr;
+	RowVector4s dphi_dqwr = dphi_dgw*dgw_dqwr;
 
-	Eigen::Matrix<double, 6, 4> dy_dqwr;
+	Eigen::Matrix<ekf_scalar, 6, 4> dy_dqwr;
 	dy_dqwr.setZero();
 	dy_dqwr.block<1, 4>(3, 0) = dtheta_dqwr;
 	dy_dqwr.block<1, 4>(4, 0) = dphi_dqwr;
 
-	Eigen::MatrixXd dy_drw(6, 3);
+	Eigen::Matrix<ekf_scalar, 6, 3> dy_drw;
 	dy_drw.setZero();
 	dy_drw.block<3, 3>(0, 0).setIdentity();
 
-	Eigen::Matrix<double, 6, 13> dy_dxv;
 	dy_dxv.setZero();
 	dy_dxv.block<6, 3>(0, 0) = dy_drw;
 	dy_dxv.block<6, 4>(0, 3) = dy_dqwr;
 
-	Eigen::Matrix<double, 5, 3> dyprima_dgw;
+	Eigen::Matrix<ekf_scalar, 5, 3> dyprima_dgw;
 	dyprima_dgw.setZero();
 	dyprima_dgw.block<1, 3>(3, 0) = dtheta_dgw;
 	dyprima_dgw.block<1, 3>(4, 0) = dphi_dgw;
 
-	Eigen::Matrix<double, 3, 2> dgc_dhu;
+	Eigen::Matrix<ekf_scalar, 3, 2> dgc_dhu;
 	cam.jacob_uvu_to_homogeneous(dgc_dhu);
 
-	Eigen::Matrix2d dhu_dhd;
+	Matrix2s dhu_dhd;
 	cam.jacob_undistort( uv_d, dhu_dhd );
 
-	Eigen::Matrix<double, 5, 2> dyprima_dhd = dyprima_dgw*qWR_rotation_matrix*dgc_dhu*dhu_dhd; //dgw_dgc = qWR_rotation_matrix
+	Eigen::Matrix<ekf_scalar, 5, 2> dyprima_dhd = dyprima_dgw*qWR_rotation_matrix*dgc_dhu*dhu_dhd; //dgw_dgc = qWR_rotation_matrix
 
-	Eigen::Matrix<double, 6, 3> dy_dhd;
 	dy_dhd.setZero();
 	dy_dhd.block<5, 2>(0, 0) = dyprima_dhd;
 	dy_dhd(5,2) = 1;
+}
 
-	Eigen::Matrix3d Padd; //TODO: std_pxl should be parametrizable
-	Padd.setIdentity(); //Initial std_pxl = 1, and std_rho = 1. Block(0,0,1,1) = I * std_pxl^2, pos(2, 2) = std_rho^2
-
-
-	//	P_xv = P( 1:13, 1:13 ); //Correlation of Camera with itself
-	//	P_yxv = P( 14:end, 1:13 ); //Correlation of features with camera
-	//	P_y = P( 14:end, 14:end ); //Correlation of features with features
-	//	P_xvy = P( 1:13, 14:end ); //Correlation of camera with features
-	//	p_k_k = [ P_xv          P_xvy                       P_xv*dy_dxv';
-	//	          P_yxv         P_y                         P_yxv*dy_dxv';
-	//	          dy_dxv*P_xv   dy_dxv*P_xvy                dy_dxv*P_xv*dy_dxv'+...
-	//	                                                    dy_dhd*Padd*dy_dhd'];
+void Kalman::add_a_feature_state_anchored_inverse_depth( const Vector3s & XYZ_w, const int insert_point){
+	Vector3s newFeature;
 
+	//A projected point is expressed in terms of the camera position when it was first seen (its anchor, already in the state).
+	//Its values are the azimuth, elevation and ray length (distance to the camera position). It is calculated from the quaternion that describes the orientation of the camera:
+	// XYZ_w is the undistorted homogeneous coordinates rotated by the orientation (qWR). In other words XYZ_w is the direction vector of the ray.
+	ekf_scalar nx=XYZ_w(0);
+	ekf_scalar ny=XYZ_w(1);
+	ekf_scalar nz=XYZ_w(2);
 
-	//Note: p_x_x might be large, so using dynamic allocation to modify it.
-	// Correlation of the new feature with the camera state info (first 13 positions) and viceversa:
-	p_k_k_.block(0, insert_point, 13, 6) = p_k_k_.topLeftCorner(13,13)*dy_dxv.transpose(); //P_xv*dy_dxv'
-	p_k_k_.block(insert_point, 0, 6, 13) = dy_dxv*p_k_k_.topLeftCorner(13,13); //dy_dxv*P_xv
+	//(Feature::ANCHORED_HOMOGENEOUS features store the ray direction itself instead, see add_features_inverse_depth)
+	newFeature(0) = std::atan2(nx,nz); //azimuth
+	newFeature(1) = std::atan2(-ny,sqrt(nx*nx+nz*nz)); //elevation
+	newFeature(2) = 1 ; //Initially guessed ray length (a positive number since it has to be in front of the camera, the EKF takes care to later improve this guess)
 
-	//dy_dxv*P_xv*dy_dxv'+dy_dhd*Padd*dy_dhd' = correlation between this feature properties:
-	p_k_k_.block(insert_point, insert_point, 6, 6) = dy_dxv*p_k_k_.topLeftCorner(13,13)*dy_dxv.transpose() + dy_dhd*Padd*dy_dhd.transpose();
+	x_k_k_.segment<3>(insert_point) = newFeature;
+}
 
-//	//If other features already existed, compute the correlation of this feature with the old features
-	if (insert_point > 13) {
-		//Correlation of old features with camera:
-		Eigen::MatrixXd P_yxv = p_k_k_.block(13, 0, insert_point-13, 13);
-		Eigen::MatrixXd P_xvy = p_k_k_.block(0, 13, 13, insert_point-13);
+void Kalman::features_layout(std::vector<Features_extra> & features_extra) const{
+	size_t num_features = 0;
+	for (size_t b=0 ; b<state_blocks_.size() ; b++){
+		if (state_blocks_[b] != ANCHOR_BLOCK)
+			num_features++;
+	}
+	features_extra.resize(num_features);
+
+	size_t i = 0; //feature counter
+	int anchor_start_pos = -1;
+	int block_start_pos = 13;
+	for (size_t b=0 ; b<state_blocks_.size() ; block_start_pos += block_size(state_blocks_[b]), b++){
+		if (state_blocks_[b] == ANCHOR_BLOCK){
+			anchor_start_pos = block_start_pos;
+			continue;
+		}
 
-		p_k_k_.block(13, insert_point, insert_point-13, 6) = P_yxv*dy_dxv.transpose(); //P_yxv*dy_dxv' = correlation of the new feature with the already existing features (pos 14-> insert_point)
-		p_k_k_.block(insert_point, 13, 6, insert_point-13) = dy_dxv*P_xvy; //dy_dxv*P_xvy = correlation of the new feature with the already existing features (pos 14-> insert_point)
+		features_extra[i].parametrization = (Feature::Parametrization)state_blocks_[b];
+		features_extra[i].yi_start_pos = block_start_pos;
+		features_extra[i].yi_size = block_size(state_blocks_[b]);
+		features_extra[i].anchor_start_pos = (state_blocks_[b] == Feature::ANCHORED_INVERSE_DEPTH || state_blocks_[b] == Feature::ANCHORED_HOMOGENEOUS) ? anchor_start_pos : -1;
+		i++;
 	}
 }
 
-void Kalman::add_a_feature_state_inverse_depth( const Eigen::VectorXd & XYZ_w, const int insert_point){
-	Eigen::VectorXd newFeature(6);
+Feature::StateVector Kalman::feature_state(const Eigen::Ref<const VectorXs> & x_k_k, const Features_extra & feature){
+	if (feature.anchor_start_pos < 0)
+		return x_k_k.segment(feature.yi_start_pos, feature.yi_size);
 
-	//A projected point is expressed in terms of the camera position when it was first seen.
-	//So the first 3 positions are equal to the first 3 positions of the state vector (the translation):
-	newFeature.head(3) = x_k_k_.head(3);
-
-	//The last three are the azimuth, elevation and ray length (distance to the camera position). It is calculated from the quaternion that describes the orientation of the camera:
-	// XYZ_w is the undistorted homogeneous coordinates rotated by the orientation (qWR). In other words XYZ_w is the direction vector of the ray.
-	double nx=XYZ_w(0);
-	double ny=XYZ_w(1);
-	double nz=XYZ_w(2);
-
-	//TODO: convert azimuth and elevation to homogeneous coordinates not from angles but from the positions in the image! (Anchored homogeneous points)
-	newFeature(3) = std::atan2(nx,nz); //azimuth
-	newFeature(4) = std::atan2(-ny,sqrt(nx*nx+nz*nz)); //elevation
-	newFeature(5) = 1 ; //Initially guessed ray length (a positive number since it has to be in front of the camera, the EKF takes care to later improve this guess)
-
-	x_k_k_.segment(insert_point, 6) = newFeature;
+	Feature::StateVector yi(3 + feature.yi_size);
+	yi << x_k_k.segment<3>(feature.anchor_start_pos), x_k_k.segment(feature.yi_start_pos, feature.yi_size);
+	return yi;
 }
 
 /*
  * compute_h:
- * Computes 'h' for each feature, 'hi' is the predicted image position of a feature.
+ * Computes 'h' for each feature, 'hi' is the predicted image position of a feature, and its Jacobian 'H' (used by the update,
+ * the state does not change in between). The features are projected as a batch (Feature::project), then H is computed per feature
+ * from the intermediate results of the projection, and with it the innovation covariance of each feature (S, for the tracker).
  */
 void Kalman::compute_features_h(const Camera & cam, std::vector<Features_extra> & features_extra){
-	Eigen::Vector3d rW = x_k_k_.head(3); //current camera position
-	Eigen::Vector4d qWR = x_k_k_.segment(3, 4);//current camera orientation
-	Eigen::Matrix3d qWR_rotation_matrix;
+	const Vector3s rW = x_k_k_.head<3>(); //current camera position
+	const Vector4s qWR = x_k_k_.segment<4>(3);//current camera orientation
+	Matrix3s qWR_rotation_matrix;
 	MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
 
-	//compute 'h' and its Jacobian 'H' for each feature:
-	for(int yi_start_pos = 13; yi_start_pos < x_k_k_.rows(); yi_start_pos+=6) {
+	Eigen::Matrix<ekf_scalar, Feature::HOMOGENEOUS_SIZE, 1> anchored_yi; //(anchor, own values) of an anchored feature, gathered without allocating
+
+	//Gather the features into the lanes of projections_ and compute all the 'h' at once:
+	features_layout(features_extra);
+	const int num_features = features_extra.size();
+	projections_.resize(num_features);
+	for(int i = 0; i < num_features; i++) {
+		const Features_extra & feature = features_extra[i];
+		if (feature.anchor_start_pos >= 0){
+			anchored_yi.head<3>() = x_k_k_.segment<3>(feature.anchor_start_pos);
+			anchored_yi.segment(3, feature.yi_size) = x_k_k_.segment(feature.yi_start_pos, feature.yi_size);
+			Feature::set_lane( anchored_yi.head(3 + feature.yi_size), projections_, i );
+		} else {
+			Feature::set_lane( x_k_k_.segment(feature.yi_start_pos, feature.yi_size), projections_, i );
+		}
+	}
+	Feature::project( cam, rW, qWR_rotation_matrix, projections_ );
+
+	//compute the Jacobian 'H' of each feature:
+	for(int i = 0; i < num_features; i++) {
+		Features_extra & feature = features_extra[i];
+		feature.h << projections_.u(i), projections_.v(i);
+
+		//if the feature is in front of its anchor (positive inverse depth), mark it as valid:
+		if (feature.anchor_start_pos >= 0){
+			const int yi_size = 3 + feature.yi_size;
+			anchored_yi.head<3>() = x_k_k_.segment<3>(feature.anchor_start_pos);
+			anchored_yi.segment(3, feature.yi_size) = x_k_k_.segment(feature.yi_start_pos, feature.yi_size);
 
-		Eigen::VectorXd yi = x_k_k_.segment(yi_start_pos, 6); //feature_state
-		features_extra.push_back(Features_extra());
+			feature.is_valid = Feature::compute_H( cam, rW, qWR, qWR_rotation_matrix, anchored_yi.head(yi_size), projections_, i, feature.H_xv, feature.H_yi );
 
-		Feature::compute_h( cam, rW, qWR_rotation_matrix, yi, features_extra.back().h );
+			//The derivative against (anchor, own values) is split into the anchor and the feature own values:
+			feature.H_anchor = feature.H_yi.leftCols<3>();
+			feature.H_yi.leftCols(feature.yi_size) = feature.H_yi.middleCols(3, feature.yi_size).eval();
+		} else {
+			feature.is_valid = Feature::compute_H( cam, rW, qWR, qWR_rotation_matrix, x_k_k_.segment(feature.yi_start_pos, feature.yi_size), projections_, i, feature.H_xv, feature.H_yi );
+		}
 
-		// if the feature is prediction is in front of the camera, mark it as valid:
-		if (yi[5] > 0){//yi[5] is the depth.
-			features_extra.back().is_valid = true;
+		if (feature.is_valid){
+			feature.S = innovation_covariance(feature);
 		} else {
-			features_extra.back().is_valid = false;
-			std::cout << "invalidated: " << features_extra.size()-1 << std::endl;
+			std::cout << "invalidated: " << i << std::endl;
 		}
 	}
+
+	if (max_features_ > 0 && eviction_policy_ != NULL){
+		evict_features(features_extra);
+	}
 }
 
 /*
- * update:
- * With the camera parameters and observations (mapped to the current state features) it corrects the state and covariance matrix of the EKF.
+ * innovation_covariance:
+ * S = H*P*H' + R of a single feature. H is only non-zero at the camera, at the feature and at its anchor, so only those blocks of P
+ * take part.
  */
-void Kalman::update(const Camera & cam, std::vector<Features_extra> & features_extra){
-	assert(x_k_k_.rows()>0);
-	assert(p_k_k_.rows()>0);
-	assert(((size_t)x_k_k_.rows()-13)/6 == features_extra.size());
-	assert(((size_t)p_k_k_.rows()-13)/6 == features_extra.size());
+Matrix2s Kalman::innovation_covariance(const Features_extra & feature) const{
+	const int yi_start_pos = feature.yi_start_pos;
+	const int yi_size = feature.yi_size;
+	const Eigen::Matrix<ekf_scalar, 2, Eigen::Dynamic, Eigen::RowMajor, 2, 7> H_yi = feature.H_yi.leftCols(yi_size);
+
+	Matrix2s S = feature.H_xv*p_k_k_.block<13, 13>(0, 0)*feature.H_xv.transpose();
+	S.noalias() += H_yi*p_k_k_.block(yi_start_pos, yi_start_pos, yi_size, yi_size)*H_yi.transpose();
+	Matrix2s cross = feature.H_xv*p_k_k_.block(0, yi_start_pos, 13, yi_size)*H_yi.transpose(); //and its transpose
+	if (feature.anchor_start_pos >= 0){
+		const int anchor_start_pos = feature.anchor_start_pos;
+		S.noalias() += feature.H_anchor*p_k_k_.block<3, 3>(anchor_start_pos, anchor_start_pos)*feature.H_anchor.transpose();
+		cross.noalias() += feature.H_xv*p_k_k_.block<13, 3>(0, anchor_start_pos)*feature.H_anchor.transpose();
+		cross.noalias() += feature.H_anchor*p_k_k_.block(anchor_start_pos, yi_start_pos, 3, yi_size)*H_yi.transpose();
+	}
+	S += cross + cross.transpose();
+	S.diagonal().array() += std_z_*std_z_;
 
-	//Return if there were no observations:
-	if (features_extra.size() == 0)
-		return;
+	return S;
+}
 
-	Eigen::Vector3d rW = x_k_k_.head(3); //current camera position
-	Eigen::Vector4d qWR = x_k_k_.segment(3, 4);//current camera orientation
-	Eigen::Matrix3d qWR_rotation_matrix;
-	MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
+/*
+ * evict_features:
+ * Keeps at most max_features_ valid features, the least relevant ones (by eviction_policy_) are marked as not valid.
+ * Like any other not valid feature, the tracker stops tracking them and delete_features marginalises them out of the state
+ * (their rows and columns are removed), before the update. So the update never works with more than max_features_ features.
+ */
+void Kalman::evict_features(std::vector<Features_extra> & features_extra){
+	std::vector<ekf_scalar> relevance;
+	eviction_policy_->compute_relevance(x_k_k(), p_k_k(), features_extra, relevance);
 
-	//compute h Jacobian: 'H' for each feature:
-	for(size_t i=0; i<features_extra.size(); i++) {
+	std::vector< std::pair<ekf_scalar, size_t> > candidates; //(relevance, feature index) of the valid features
+	for (size_t i=0 ; i<features_extra.size() ; i++){
 		if (features_extra[i].is_valid){
-			int yi_start_pos = 13 + i*6;
-			Eigen::VectorXd yi = x_k_k_.segment(yi_start_pos, 6); //feature_state
-
-			Feature::compute_H( cam, rW, qWR, qWR_rotation_matrix, x_k_k_, yi, yi_start_pos, features_extra[i].h, features_extra[i].H );
+			candidates.push_back(std::make_pair(relevance[i], i));
 		}
 	}
-	Eigen::VectorXd z(features_extra.size()*2); //each observation uses 2 doubles, for U and V.
-	Eigen::VectorXd h(features_extra.size()*2); //each observation uses 2 doubles, for the predicted U and V.
-	Eigen::MatrixXd H(features_extra.size()*2, x_k_k_.rows());
-	Eigen::MatrixXd R;
-	R.setIdentity(features_extra.size()*2, features_extra.size()*2);
+
+	const int num_to_evict = (int)candidates.size() - max_features_;
+	if (num_to_evict <= 0)
+		return;
+
+	//Only the num_to_evict least relevant ones need to be found, not sorted:
+	std::nth_element(candidates.begin(), candidates.begin() + num_to_evict, candidates.end());
+	for (int k=0 ; k<num_to_evict ; k++){
+		features_extra[candidates[k].second].is_valid = false;
+	}
+}
+
+/*
+ * update:
+ * With the observations (mapped to the current state features) it corrects the state and covariance matrix of the EKF.
+ * features_extra comes from compute_features_h (h and H of each feature) after delete_features, only the positions of the features in the state
+ * have changed since then.
+ */
+void Kalman::update(std::vector<Features_extra> & features_extra){
+	assert(state_size_>0);
+	last_update_observations_ = 0;
+
+	//Return if there were no observations:
+	if (features_extra.size() == 0)
+		return;
+
+	features_layout(features_extra);
+	//Only the valid observations take part in the update:
+	std::vector<size_t> observed;
 	for (size_t i = 0; i != features_extra.size(); i++) {
 		if (features_extra[i].is_valid){
-			z.segment(i*2, 2) = features_extra[i].z;
-			h.segment(i*2, 2) = features_extra[i].h;
-			H.block(i*2, 0, 2, x_k_k_.rows()) = features_extra[i].H;
+			observed.push_back(i);
 		}
 	}
 
-	//TODO: Optimize in a per feature basis and maybe parallelize, as Joan Sola's "SLAM course.pdf" suggest.
-	//filter gain
-	Eigen::MatrixXd S = H*p_k_k_*H.transpose() + R;
-	Eigen::MatrixXd K = p_k_k_*H.transpose()*S.inverse();
+	if (observed.size() == 0)
+		return;
 
-	//updated state and covariance
-	x_k_k_ += K*( z - h );
-	p_k_k_ -= K*S*K.transpose();
+	if (update_mode_ == UPDATE_SEQUENTIAL){
+		update_sequential(features_extra, observed);
+	} else {
+		update_batch(features_extra, observed);
+	}
 
 	//normalize the quaternion
-	Eigen::Matrix4d Jnorm;
+	Matrix4s Jnorm;
 	Kalman::normalize_jac( x_k_k_.segment<4>(3), Jnorm );
 
 
@@ -343,11 +638,211 @@ void Kalman::update(const Camera & cam, std::vector<Features_extra> & features_e
 
 	//Update the covariance matrix that are related to the quaternion (qWC):
 	//cols:
-	p_k_k_.block(3, 0, 4, p_k_k_.cols()).applyOnTheLeft(Jnorm); // p_k_k(4:7, :) = Jnorm * p_k_k(4:7, :)
+	p_k_k_.block(3, 0, 4, state_size_).applyOnTheLeft(Jnorm); // p_k_k(4:7, :) = Jnorm * p_k_k(4:7, :)
 
 	//rows:
-	p_k_k_.block(0, 3, p_k_k_.rows(), 4).applyOnTheRight(Jnorm.transpose()); // p_k_k(:, 4:7) = p_k_k(:, 4:7) * Jnorm'
+	p_k_k_.block(0, 3, state_size_, 4).applyOnTheRight(Jnorm.transpose()); // p_k_k(:, 4:7) = p_k_k(:, 4:7) * Jnorm'
 
 	//Don't forget to normalize the orientation in the state
 	x_k_k_.segment<4>(3).normalize();
+
+	if (cartesian_linearity_threshold_ > 0){
+		convert_features_to_cartesian();
+	}
+
+	//keep the covariance matrix exactly symmetric (the round-off of the corrections above is not):
+	p_k_k_.topLeftCorner(state_size_, state_size_).triangularView<Eigen::StrictlyUpper>() = p_k_k_.topLeftCorner(state_size_, state_size_).transpose();
+}
+
+/*
+ * update_batch:
+ * Corrects the state and covariance matrix with all the observations at once (2m x 2m innovation covariance).
+ */
+void Kalman::update_batch(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & observed){
+	const int size_x = state_size_;
+	const int size_z = observed.size()*2; //each observation uses 2 doubles, for U and V.
+
+	MeasurementVector z(size_z);
+	MeasurementVector h(size_z);
+
+	//Each row pair of H is only non-zero at the camera (first 13 columns, H_xv), at its own feature (6 or 3 columns, H_yi) and at its
+	//anchor if it is shared (3 columns, H_anchor), so P*H' is built from those column blocks of P, instead of multiplying by the dense H:
+	//  P*Hi' = P(:, 1:13)*Hi(:, 1:13)' + P(:, yi)*Hi(:, yi)' [+ P(:, anchor)*Hi(:, anchor)']
+	StateMeasurementMatrix PHt(size_x, size_z);
+	for (size_t k = 0; k != observed.size(); k++) {
+		const Features_extra & feature = features_extra[observed[k]];
+
+		z.segment<2>(k*2) = feature.z;
+		h.segment<2>(k*2) = feature.h;
+
+		PHt.middleCols<2>(k*2).noalias() = p_k_k_.block<Eigen::Dynamic, 13>(0, 0, size_x, 13)*feature.H_xv.transpose();
+		PHt.middleCols<2>(k*2).noalias() += p_k_k_.block(0, feature.yi_start_pos, size_x, feature.yi_size)*feature.H_yi.leftCols(feature.yi_size).transpose();
+		if (feature.anchor_start_pos >= 0){
+			PHt.middleCols<2>(k*2).noalias() += p_k_k_.block<Eigen::Dynamic, 3>(0, feature.anchor_start_pos, size_x, 3)*feature.H_anchor.transpose();
+		}
+	}
+
+	//S = H*P*H' + R, with the same structure applied to the rows of P*H'. R is diagonal (std_z^2 on each image coordinate):
+	InnovationMatrix S(size_z, size_z);
+	for (size_t k = 0; k != observed.size(); k++) {
+		const Features_extra & feature = features_extra[observed[k]];
+
+		S.middleRows<2>(k*2).noalias() = feature.H_xv*PHt.topRows<13>();
+		S.middleRows<2>(k*2).noalias() += feature.H_yi.leftCols(feature.yi_size)*PHt.middleRows(feature.yi_start_pos, feature.yi_size);
+		if (feature.anchor_start_pos >= 0){
+			S.middleRows<2>(k*2).noalias() += feature.H_anchor*PHt.middleRows<3>(feature.anchor_start_pos);
+		}
+	}
+	S.diagonal().array() += std_z_*std_z_;
+
+	//S is symmetric and positive definite, so factorise it once (S = L*L') instead of inverting it:
+	Eigen::LLT<InnovationMatrix> S_llt(S);
+	if (S_llt.info() != Eigen::Success){
+		std::cout << "update skipped: innovation covariance is not positive definite" << std::endl;
+		return;
+	}
+
+	//updated state: x_k_k += K*(z - h), with K = P*H'*inv(S)
+	x_k_k_.head(size_x).noalias() += PHt*S_llt.solve( z - h );
+	last_update_observations_ = observed.size();
+
+#ifdef EKFOA_USE_FLOAT
+	//updated covariance in the Joseph form, that needs K = P*H'*inv(S) explicitly:
+	const StateMeasurementMatrix K = S_llt.solve(PHt.transpose()).transpose();
+	joseph_form(PHt, K, S);
+#else
+	//updated covariance: p_k_k -= K*S*K' = (P*H')*inv(S)*(P*H')' = W'*W, with W = inv(L)*(P*H')'
+	MeasurementStateMatrix W = PHt.transpose();
+	S_llt.matrixL().solveInPlace(W);
+
+	//symmetric rank-k downdate of the lower triangle:
+	p_k_k_.topLeftCorner(size_x, size_x).selfadjointView<Eigen::Lower>().rankUpdate(W.transpose(), -1);
+#endif
+	//mirror the lower triangle into the upper one:
+	p_k_k_.topLeftCorner(size_x, size_x).triangularView<Eigen::StrictlyUpper>() = p_k_k_.topLeftCorner(size_x, size_x).transpose();
+}
+
+/*
+ * update_sequential:
+ * Corrects the state and covariance matrix with one observation at a time (2x2 innovation covariance and a rank-2 covariance update), as Joan Sola's "SLAM course.pdf" suggest.
+ * All the observations are linearised at the predicted state, so the result is the same as update_batch. If a time budget is set, the observations left when it runs out are not used.
+ */
+void Kalman::update_sequential(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & observed){
+	const int size_x = state_size_;
+	const double time_start = (double)cv::getTickCount();
+
+	//Accumulated correction of the state. Each innovation has to account for the corrections of the previous observations: z - (h + H*dx)
+	StateVector dx = StateVector::Zero(size_x);
+	Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 2, Eigen::ColMajor, EKFOA_MAX_STATE_SIZE, 2> PHt(size_x, 2);
+	Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 2, Eigen::ColMajor, EKFOA_MAX_STATE_SIZE, 2> K(size_x, 2);
+
+	for (size_t k = 0; k != observed.size(); k++) {
+		if (update_time_budget_ >= 0 && ((double)cv::getTickCount() - time_start)*1000./cv::getTickFrequency() >= update_time_budget_){
+			break; //the rest are not used, last_update_observations tells how many were
+		}
+
+		const Features_extra & feature = features_extra[observed[k]];
+
+		PHt.noalias() = p_k_k_.block<Eigen::Dynamic, 13>(0, 0, size_x, 13)*feature.H_xv.transpose();
+		PHt.noalias() += p_k_k_.block(0, feature.yi_start_pos, size_x, feature.yi_size)*feature.H_yi.leftCols(feature.yi_size).transpose();
+		if (feature.anchor_start_pos >= 0){
+			PHt.noalias() += p_k_k_.block<Eigen::Dynamic, 3>(0, feature.anchor_start_pos, size_x, 3)*feature.H_anchor.transpose();
+		}
+
+		Matrix2s S = feature.H_xv*PHt.topRows<13>() + feature.H_yi.leftCols(feature.yi_size)*PHt.middleRows(feature.yi_start_pos, feature.yi_size);
+		S.diagonal().array() += std_z_*std_z_;
+
+		Vector2s innovation = feature.z - feature.h - feature.H_xv*dx.head<13>() - feature.H_yi.leftCols(feature.yi_size)*dx.segment(feature.yi_start_pos, feature.yi_size);
+
+		if (feature.anchor_start_pos >= 0){
+			S.noalias() += feature.H_anchor*PHt.middleRows<3>(feature.anchor_start_pos);
+			innovation.noalias() -= feature.H_anchor*dx.segment<3>(feature.anchor_start_pos);
+		}
+
+		K.noalias() = PHt*S.inverse();
+
+		dx.noalias() += K*innovation;
+#ifdef EKFOA_USE_FLOAT
+		joseph_form(PHt, K, S);
+#else
+		p_k_k_.topLeftCorner(size_x, size_x).noalias() -= K*PHt.transpose();
+#endif
+		last_update_observations_++;
+	}
+
+	x_k_k_.head(size_x) += dx;
+}
+
+/*
+ * joseph_form:
+ * Single precision covariance correction. P - K*H*P loses its symmetry and positive definiteness with float round-off, so it is
+ * computed in the Joseph form (I - K*H)*P*(I - K*H)' + K*R*K', that keeps both, instead. With P*H' and S = H*P*H' + R it expands to
+ *   P - K*(P*H')' - (P*H' - K*S)*K'
+ * where the last term is zero only for the exact gain, so it absorbs the round-off of K.
+ */
+void Kalman::joseph_form(const Eigen::Ref<const StateMeasurementMatrix> & PHt, const Eigen::Ref<const StateMeasurementMatrix> & K, const Eigen::Ref<const InnovationMatrix> & S){
+	const int size_x = state_size_;
+
+	StateMeasurementMatrix E = PHt;
+	E.noalias() -= K*S;
+
+	p_k_k_.topLeftCorner(size_x, size_x).noalias() -= K*PHt.transpose();
+	p_k_k_.topLeftCorner(size_x, size_x).noalias() -= E*K.transpose();
+}
+
+/*
+ * convert_features_to_cartesian:
+ * Switches the inverse depth (and anchored homogeneous) features whose linearity index (Feature::compute_linearity_index) is below cartesian_linearity_threshold_
+ * to a Cartesian point, as Civera et al. "Inverse Depth Parametrization for Monocular SLAM" suggest. The feature state yi becomes
+ * p = compute_cartesian(yi) and its rows and columns of the covariance matrix are transformed with J = dp_dy:
+ *   P(:, p) = P(:, yi)*J'   P(p, :) = J*P(yi, :)   (so P(p, p) = J*P(yi, yi)*J')
+ * For an anchored feature yi = (anchor, own values) and p replaces its own values, the anchor stays for the rest of its features.
+ * Then the values no longer needed (and the anchors left without features) are removed from the state.
+ */
+void Kalman::convert_features_to_cartesian(){
+	const Vector3s rW = x_k_k_.head<3>(); //current camera position
+	bool converted = false;
+
+	std::vector<Features_extra> features;
+	features_layout(features);
+
+	std::vector<int> new_blocks(state_blocks_);
+	size_t i = 0; //feature counter
+	for (size_t b=0 ; b<state_blocks_.size() ; b++){
+		if (state_blocks_[b] == ANCHOR_BLOCK)
+			continue;
+
+		const Features_extra & feature = features[i++];
+		const int yi_start_pos = feature.yi_start_pos;
+		const int rho_index = yi_start_pos + feature.yi_size - 1;
+
+		if (feature.parametrization != Feature::CARTESIAN && x_k_k_(rho_index) > 0){
+			const Feature::StateVector yi = feature_state(x_k_k(), feature);
+			const ekf_scalar sigma_rho = std::sqrt(p_k_k_(rho_index, rho_index));
+
+			if (Feature::compute_linearity_index(rW, yi, sigma_rho) < cartesian_linearity_threshold_){
+				Eigen::Matrix<ekf_scalar, 3, 7> dp_dy;
+				Feature::compute_cartesian_jacobian(yi, dp_dy);
+
+				//columns first, then rows (which then include the new P(p, p) block):
+				if (feature.anchor_start_pos >= 0){
+					const int anchor_start_pos = feature.anchor_start_pos;
+					const int own_size = feature.yi_size;
+					p_k_k_.block<Eigen::Dynamic, 3>(0, yi_start_pos, state_size_, 3) = (p_k_k_.block<Eigen::Dynamic, 3>(0, anchor_start_pos, state_size_, 3)*dp_dy.leftCols<3>().transpose() + p_k_k_.block(0, yi_start_pos, state_size_, own_size)*dp_dy.middleCols(3, own_size).transpose()).eval();
+					p_k_k_.block<3, Eigen::Dynamic>(yi_start_pos, 0, 3, state_size_) = (dp_dy.leftCols<3>()*p_k_k_.block<3, Eigen::Dynamic>(anchor_start_pos, 0, 3, state_size_) + dp_dy.middleCols(3, own_size)*p_k_k_.block(yi_start_pos, 0, own_size, state_size_)).eval();
+				} else {
+					p_k_k_.block<Eigen::Dynamic, 3>(0, yi_start_pos, state_size_, 3) = (p_k_k_.block<Eigen::Dynamic, 6>(0, yi_start_pos, state_size_, 6)*dp_dy.leftCols<6>().transpose()).eval();
+					p_k_k_.block<3, Eigen::Dynamic>(yi_start_pos, 0, 3, state_size_) = (dp_dy.leftCols<6>()*p_k_k_.block<6, Eigen::Dynamic>(yi_start_pos, 0, 6, state_size_)).eval();
+				}
+				x_k_k_.segment<3>(yi_start_pos) = Feature::compute_cartesian(yi);
+
+				new_blocks[b] = Feature::CARTESIAN;
+				converted = true;
+			}
+		}
+	}
+
+	if (converted){
+		reshape_state(new_blocks);
+	}
 }
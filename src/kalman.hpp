@@ -4,6 +4,7 @@
 #include "feature.hpp"   //Feature
 #include "camera.hpp"   //Feature
 #include "motion_model.hpp"   //Motion model
+#include "feature_eviction.hpp" //FeatureEvictionPolicy
 #include "print.hpp"
 
 #include <Eigen/Dense> //Matrix
@@ -14,83 +15,178 @@
 #include <Eigen/Eigen> //math
 #include <iostream>    //cout
 #include <vector>   //vector
-
+#include <algorithm> //nth_element
+
+/*
+ * EKFOA_MAX_FEATURES (build option): maximum number of features in the filter, known at compile time.
+ * When it is defined, the state, the covariance matrix and the temporaries of the update are statically sized (no heap allocation),
+ * otherwise they grow as needed.
+ */
+#ifdef EKFOA_MAX_FEATURES
+#define EKFOA_MAX_STATE_SIZE (13 + 7*EKFOA_MAX_FEATURES) //at most one anchor and 4 values per feature
+#define EKFOA_MAX_MEASUREMENT_SIZE (2*EKFOA_MAX_FEATURES)
+#define EKFOA_MAX_NEW_FEATURES_SIZE (7*EKFOA_MAX_FEATURES)
+#else
+#define EKFOA_MAX_STATE_SIZE Eigen::Dynamic
+#define EKFOA_MAX_MEASUREMENT_SIZE Eigen::Dynamic
+#define EKFOA_MAX_NEW_FEATURES_SIZE Eigen::Dynamic
+#endif
 
 struct Features_extra{
 	bool is_valid;
 	cv::Point2f z_cv; //the feature actual observation coordinates as an openCV point
-	Eigen::Vector2d z; //the feature actual observation coordinates
-	Eigen::Vector2d h; //the feature state estimation represented in image coordinates
-	Eigen::MatrixXd H; //the feature derivative against the current state (x_k_k)
+	Vector2s z; //the feature actual observation coordinates
+	Vector2s h; //the feature state estimation represented in image coordinates
+	//The derivative of h against the current state (x_k_k) is only non-zero at the camera, at the feature anchor and at the feature itself, so only those blocks are stored:
+	Eigen::Matrix<ekf_scalar, 2, 13> H_xv; //the feature derivative against the camera state (first 13 positions of x_k_k)
+	Eigen::Matrix<ekf_scalar, 2, 7> H_yi; //the feature derivative against its own state (yi), only its first yi_size columns are used
+	Eigen::Matrix<ekf_scalar, 2, 3> H_anchor; //the feature derivative against its shared anchor, only for anchored features
+	Matrix2s S; //innovation covariance of the feature alone (H*P*H' + R), only for valid features. The tracker searches the feature within it
+	Feature::Parametrization parametrization;
+	int yi_start_pos; //where the feature state (yi) starts in x_k_k, i.e. the column of H_yi in the full Jacobian
+	int yi_size; //size of the feature state: 6 for inverse depth features, 3 for anchored inverse depth and Cartesian ones, 4 for anchored homogeneous ones
+	int anchor_start_pos; //where the shared anchor (x, y, z) of an anchored feature starts in x_k_k, -1 for the others
 };
 
 
 class Kalman {
 public:
-	Kalman(double v_0, double std_v_0, double w_0, double std_w_0, double sigma_a, double sigma_alpha, double sigma_image_noise);
-	Kalman(const Eigen::VectorXd & x_k_k, const Eigen::MatrixXd & p_k_k, double sigma_a, double sigma_alpha, double sigma_image_noise);
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 1, Eigen::ColMajor, EKFOA_MAX_STATE_SIZE, 1> StateVector;
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, EKFOA_MAX_STATE_SIZE, EKFOA_MAX_STATE_SIZE> CovarianceMatrix;
+
+	enum UpdateMode {
+		UPDATE_BATCH,     //all the observations at once
+		UPDATE_SEQUENTIAL //one observation at a time, no 2m x 2m matrices
+	};
+
+	Kalman(ekf_scalar v_0, ekf_scalar std_v_0, ekf_scalar w_0, ekf_scalar std_w_0, ekf_scalar sigma_a, ekf_scalar sigma_alpha, ekf_scalar sigma_image_noise);
+	Kalman(const VectorXs & x_k_k, const MatrixXs & p_k_k, ekf_scalar sigma_a, ekf_scalar sigma_alpha, ekf_scalar sigma_image_noise);
 
-	static bool is_feature_valid(const Features_extra & feature_extra){
-	    return feature_extra.is_valid == false;
-	}
 	void delete_features(std::vector<Features_extra> & features_extra);
-	void predict_state_and_covariance(const double delta_t);
-	void add_features_inverse_depth(const Camera & cam, const std::vector<cv::Point2f> & new_features_uvd_list);
-	void set_state_position_value(const int index, const double value){
+	void predict_state_and_covariance(const ekf_scalar delta_t);
+	int add_features_inverse_depth(const Camera & cam, const std::vector<cv::Point2f> & new_features_uvd_list);
+	void set_state_position_value(const int index, const ekf_scalar value){
 		x_k_k_(index) = value;
 	}
 	void compute_features_h(const Camera & cam, std::vector<Features_extra> & features_extra);
-	void update(const Camera & cam, std::vector<Features_extra> & features_extra);
-	Eigen::VectorXd x_k_k() const { return x_k_k_; }
-	Eigen::MatrixXd p_k_k() const { return p_k_k_; }
+	void update(std::vector<Features_extra> & features_extra);
+	void set_update_mode(const UpdateMode update_mode){
+		update_mode_ = update_mode;
+	}
+	//Maximum time (ms) of a sequential update, the rest of observations are discarded (0 discards all of them). Negative means no limit.
+	void set_update_time_budget(const double update_time_budget){
+		update_time_budget_ = update_time_budget;
+	}
+	//Observations the last update corrected the state with (fewer than the valid ones if the time budget ran out):
+	int last_update_observations() const { return last_update_observations_; }
+	void reserve_features(const int max_features);
+	//Inverse depth features with a linearity index below linearity_threshold are switched to Cartesian points after each update (0 means never, ~0.1 is usual).
+	void set_cartesian_linearity_threshold(const ekf_scalar linearity_threshold){
+		cartesian_linearity_threshold_ = linearity_threshold;
+	}
+	//Fills the parametrization and the position in the state of each feature (and its anchor), in state order. The other fields are kept:
+	void features_layout(std::vector<Features_extra> & features_extra) const;
+	//The yi of a feature as Feature expects it (an anchored feature gets its anchor in front of its own values):
+	static Feature::StateVector feature_state(const Eigen::Ref<const VectorXs> & x_k_k, const Features_extra & feature);
+	//How the next features are added: Feature::ANCHORED_INVERSE_DEPTH (default) or Feature::ANCHORED_HOMOGENEOUS (no trigonometric functions):
+	void set_new_features_parametrization(const Feature::Parametrization parametrization){
+		new_features_parametrization_ = parametrization;
+	}
+	//Hard limit of features in the state (0 means no limit). add_features_inverse_depth does not add features over it, and if it is lowered below the
+	//features in the state, compute_features_h evicts the least relevant ones over it, according to eviction_policy (not owned).
+	void set_max_features(const int max_features, FeatureEvictionPolicy * eviction_policy){
+		max_features_ = max_features;
+		eviction_policy_ = eviction_policy;
+	}
+	//The live part of the state and covariance matrix (their storage may have room for more features):
+	Eigen::VectorBlock<const StateVector> x_k_k() const { return x_k_k_.head(state_size_); }
+	Eigen::Block<const CovarianceMatrix> p_k_k() const { return p_k_k_.topLeftCorner(state_size_, state_size_); }
 
 private:
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 1, Eigen::ColMajor, EKFOA_MAX_MEASUREMENT_SIZE, 1> MeasurementVector; //z, h
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, EKFOA_MAX_STATE_SIZE, EKFOA_MAX_MEASUREMENT_SIZE> StateMeasurementMatrix; //P*H'
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, EKFOA_MAX_MEASUREMENT_SIZE, EKFOA_MAX_STATE_SIZE> MeasurementStateMatrix; //H*P
+	typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, EKFOA_MAX_MEASUREMENT_SIZE, EKFOA_MAX_MEASUREMENT_SIZE> InnovationMatrix; //S
+
+	ekf_scalar std_a_;     //standar deviation for linear acceleration noise
+	ekf_scalar std_alpha_; //standar deviation for angular acceleration noise
+	ekf_scalar std_z_;     //standar deviation for measurement noise
+
+	UpdateMode update_mode_;
+	double update_time_budget_; //ms, only used by the sequential update
+	int last_update_observations_;
+
+	int max_features_;                        //0 means no limit
+	FeatureEvictionPolicy * eviction_policy_; //chooses the features to evict when there are more than max_features_
+
+	StateVector x_k_k_;        //State vector
+	CovarianceMatrix p_k_k_;   //Covariance matrix
+	int state_size_;           //Used size of x_k_k_ and p_k_k_ (13 + the size of every block), the rest are free feature slots
+
+	//The state after the camera is a sequence of blocks: features (a Feature::Parametrization) and the anchors shared by the
+	//anchored features that follow them (up to the next anchor):
+	enum {
+		ANCHOR_BLOCK = -1, //(x, y, z) camera position where a group of features was first seen
+		REMOVED_BLOCK = -2 //only used to reshape the state
+	};
+	std::vector<int> state_blocks_;
+	static int block_size(const int block);
+
+	ekf_scalar cartesian_linearity_threshold_; //0 means features are never switched to Cartesian
+	Feature::Parametrization new_features_parametrization_;
+
+	FeatureProjections projections_; //the features of compute_features_h as a structure of arrays, kept to reuse its storage
+
+	void reserve_state(const int size);
+	void gather_state(const std::vector<int> & src_index);
+	void reshape_state(std::vector<int> & new_blocks);
+	void convert_features_to_cartesian();
 
-	double std_a_;     //standar deviation for linear acceleration noise
-	double std_alpha_; //standar deviation for angular acceleration noise
-	double std_z_;     //standar deviation for measurement noise
+	void evict_features(std::vector<Features_extra> & features_extra);
+	Matrix2s innovation_covariance(const Features_extra & feature) const;
 
-	Eigen::VectorXd x_k_k_;    //State vector
-	Eigen::MatrixXd p_k_k_;    //Covariance matrix
+	void update_batch(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & observed);
+	void update_sequential(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & observed);
+	void joseph_form(const Eigen::Ref<const StateMeasurementMatrix> & PHt, const Eigen::Ref<const StateMeasurementMatrix> & K, const Eigen::Ref<const InnovationMatrix> & S);
 
-	void add_a_feature_state_inverse_depth( const Eigen::VectorXd & XYZ_w, const int insert_point);
+	void add_a_feature_state_anchored_inverse_depth( const Vector3s & XYZ_w, const int insert_point);
 
-	void add_a_feature_covariance_inverse_depth( const Camera & cam, const Eigen::Vector2d & uvd, const Eigen::Vector3d & undistorted_projection, const Eigen::Vector4d & qWR, const Eigen::Matrix3d & qWR_rotation_matrix , const Eigen::Vector3d & XYZ_w, const int insert_point );
+	void compute_a_feature_jacobians_inverse_depth( const Camera & cam, const Vector2s & uvd, const Vector3s & undistorted_projection, const Vector4s & qWR, const Matrix3s & qWR_rotation_matrix , const Vector3s & XYZ_w, Eigen::Matrix<ekf_scalar, 6, 13> & dy_dxv, Eigen::Matrix<ekf_scalar, 6, 3> & dy_dhd );
 
 
-	void dR_by_dqw(const double qw, const double qx, const double qy, const double qz, Eigen::Matrix3d & m){
+	void dR_by_dqw(const ekf_scalar qw, const ekf_scalar qx, const ekf_scalar qy, const ekf_scalar qz, Matrix3s & m){
 		m << 2*qw, -2*qz,  2*qy,
 			 2*qz,  2*qw, -2*qx,
 			-2*qy,  2*qx,  2*qw;
 	}
 
 
-	void dR_by_dqx(const double qw, const double qx, const double qy, const double qz, Eigen::Matrix3d & m){
+	void dR_by_dqx(const ekf_scalar qw, const ekf_scalar qx, const ekf_scalar qy, const ekf_scalar qz, Matrix3s & m){
 		m << 2*qx,  2*qy,   2*qz,
 			 2*qy, -2*qx,  -2*qw,
 			 2*qz,  2*qw,  -2*qx;
 	}
 
 
-	void dR_by_dqy(const double qw, const double qx, const double qy, const double qz, Eigen::Matrix3d & m){
+	void dR_by_dqy(const ekf_scalar qw, const ekf_scalar qx, const ekf_scalar qy, const ekf_scalar qz, Matrix3s & m){
 		m << -2*qy, 2*qx,  2*qw,
 			  2*qx, 2*qy,  2*qz,
 			 -2*qw, 2*qz, -2*qy;
 	}
 
-	void dR_by_dqz(const double qw, const double qx, const double qy, const double qz, Eigen::Matrix3d & m){
+	void dR_by_dqz(const ekf_scalar qw, const ekf_scalar qx, const ekf_scalar qy, const ekf_scalar qz, Matrix3s & m){
 		m << -2*qz, -2*qw, 2*qx,
 			  2*qw, -2*qz, 2*qy,
 			  2*qx,  2*qy, 2*qz;
 	}
 
-	void normalize_jac(const Eigen::Vector4d & q, Eigen::Matrix4d & J){
-		double w=q(0);
-		double x=q(1);
-		double y=q(2);
-		double z=q(3);
+	void normalize_jac(const Vector4s & q, Matrix4s & J){
+		ekf_scalar w=q(0);
+		ekf_scalar x=q(1);
+		ekf_scalar y=q(2);
+		ekf_scalar z=q(3);
 
-		double t = w*w+x*x+y*y+z*z;
+		ekf_scalar t = w*w+x*x+y*y+z*z;
 		J << x*x+y*y+z*z, 		 -w*x,		  -w*y, -w*z,
 					-x*w, w*w+y*y+z*z,		  -x*y, -x*z,
 					-y*w,		 -y*x, w*w+x*x+z*z, -y*z,
@@ -15,6 +15,21 @@ class KalmanTestCase : public CppUnit::TestCase {
 	CPPUNIT_TEST( test_add_features );
 	CPPUNIT_TEST( test_delete_features );
 	CPPUNIT_TEST( test_update );
+	CPPUNIT_TEST( test_covariance_stays_positive_semidefinite );
+	CPPUNIT_TEST( test_evict_features );
+	CPPUNIT_TEST( test_convert_features_to_cartesian );
+	CPPUNIT_TEST( test_anchored_homogeneous_features );
+	CPPUNIT_TEST( test_batch_projection );
+	CPPUNIT_TEST( test_distortion_table );
+	CPPUNIT_TEST( test_fisheye_camera );
+	CPPUNIT_TEST( test_innovation_covariance );
+	CPPUNIT_TEST( test_sequential_update );
+	CPPUNIT_TEST( test_update_time_budget );
+	CPPUNIT_TEST( test_reuse_feature_slots );
+	CPPUNIT_TEST( test_add_features_batch );
+#if defined(EKFOA_MAX_FEATURES) && defined(EIGEN_RUNTIME_NO_MALLOC)
+	CPPUNIT_TEST( test_no_heap_allocation );
+#endif
 	CPPUNIT_TEST_SUITE_END();
 
 
@@ -26,12 +41,30 @@ class KalmanTestCase : public CppUnit::TestCase {
 	void			test_delete_features ();
 	void			test_predict ();
 	void			test_update ();
+	void			test_covariance_stays_positive_semidefinite ();
+	void			test_evict_features ();
+	void			test_convert_features_to_cartesian ();
+	void			test_anchored_homogeneous_features ();
+	void			test_batch_projection ();
+	void			test_distortion_table ();
+	void			test_fisheye_camera ();
+	void			test_innovation_covariance ();
+	void			test_sequential_update ();
+	void			test_update_time_budget ();
+	void			test_reuse_feature_slots ();
+	void			test_add_features_batch ();
+#if defined(EKFOA_MAX_FEATURES) && defined(EIGEN_RUNTIME_NO_MALLOC)
+	void			test_no_heap_allocation ();
+#endif
 
 public:
 
 	void			setUp ();
 private:
-	void 			assert_state_covariance(const Eigen::VectorXd & computed_x_k_k, const Eigen::VectorXd & expcted_x_k_k, const Eigen::MatrixXd & computed_p_k_k, const Eigen::MatrixXd & expcted_p_k_k);
+	static Camera	sample_camera();
+	static Camera	ardrone_camera();
+	static Kalman	filter_with_features(const Camera & cam, const int num_features);
+	void 			assert_state_covariance(const VectorXs & computed_x_k_k, const VectorXs & expcted_x_k_k, const MatrixXs & computed_p_k_k, const MatrixXs & expcted_p_k_k);
 };
 
 
@@ -39,21 +72,58 @@ private:
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION( KalmanTestCase, "KalmanTestCase" );
 
 void KalmanTestCase::setUp (){
+	//The expected values are the double precision results, a single precision filter (EKFOA_USE_FLOAT) has to stay within delta_ of them too:
 	delta_ = 1e-4;
 //	delta_ = 1e-15;
 }
 
+/*
+ * The camera of the sample sequence the baseline tests were computed with: pixel size d = 0.0112mm, focal length f = 2.1735mm,
+ * and its distortion (k1, k2) in mm. In pixels and projection plane coordinates: fx = fy = f/d, k1*f^2 and k2*f^4.
+ */
+Camera KalmanTestCase::sample_camera(){
+	const double d = 0.0112;
+	const double f = 2.1735;
+	return Camera(f/d,    //fx
+			f/d,                //fy
+			342.5598894437880,  //cx
+			173.0343808455040,  //cy
+			0.0028450345588019*f*f,     //k1
+			0.0000000000000222*f*f*f*f  //k2
+	);
+}
+
+/*
+ * The AR.Drone front camera, in pixels and projection plane coordinates.
+ */
+Camera KalmanTestCase::ardrone_camera(){
+	return Camera(588.878779108602,  //fx
+			588.643674196636,     //fy
+			303.725019622098,     //cx
+			185.837132396075,     //cy
+			-0.550446697998159,   //k1
+			0.311341231340524     //k2
+	);
+}
+
+/*
+ * A filter at the origin with num_features inverse depth features, along a diagonal of the image, all added in the first frame.
+ */
+Kalman KalmanTestCase::filter_with_features(const Camera & cam, const int num_features){
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<num_features ; i++){
+		new_features.push_back(cv::Point2f(60 + 25*i, 40 + 13*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+	return filter;
+}
+
 void KalmanTestCase::test_add_features () {
-	//Initialize the camera parameters
-	Camera cam(0.0112,			   //d
-				342.5598894437880,  //Cx
-				173.0343808455040,  //Cy
-				0.0028450345588019, //k1
-				0.0000000000000222, //k2
-				2.1735   			//f
-		);
+	Camera cam = sample_camera();
 
-	Eigen::VectorXd initial_x_k_k(31);
+	VectorXs initial_x_k_k(31);
 	initial_x_k_k << 4.8894495233800118e-03,
 			-2.4707966881481747e-03,
 			-1.0727828539048055e-04,
@@ -86,7 +156,7 @@ void KalmanTestCase::test_add_features () {
 			-5.4776723521423909e-01,
 			1.0000000000000000e+00;
 
-	Eigen::MatrixXd initial_p_k_k(31, 31); //cov matrix
+	MatrixXs initial_p_k_k(31, 31); //cov matrix
 	initial_p_k_k <<    5.1974770946988918e-04,   1.0735329200916772e-05,   5.6141618416296799e-05,   5.9713611132931782e-07,   1.2535485862980017e-07,  -2.3809897833383908e-04,   4.6598684589980987e-05,   4.3312309122472270e-04,   8.9461076674306406e-06,   4.6784682013580659e-05,   2.0773753339680045e-07,  -3.9683549721766310e-04,   7.7665374815631287e-05,   2.2204460492503131e-16,   0.0000000000000000e+00,   0.0000000000000000e+00,   4.2416934220801014e-32,  -6.2602520856492756e-34,   0.0000000000000000e+00,   2.2204460492503131e-16,   0.0000000000000000e+00,   0.0000000000000000e+00,   1.2296567925249027e-05,   5.2946440742128997e-07,   0.0000000000000000e+00,   2.2204460492503131e-16,   0.0000000000000000e+00,   0.0000000000000000e+00,   1.4104677658313671e-31,  -7.8771967112281033e-35,   0.0000000000000000e+00,
 			   1.0735329200916772e-05,   5.3050754092620633e-04,   9.0931793960557659e-05,  -3.0167768953372284e-07,   2.3822497118880750e-04,  -1.2536269832262672e-07,  -2.8770237373292349e-05,   8.9461076674306406e-06,   4.4208961743832025e-04,   7.5776494967131383e-05,   3.9704370889004608e-04,  -2.0773753339735422e-07,  -4.7950883262559406e-05,   0.0000000000000000e+00,   2.2204460492503131e-16,   0.0000000000000000e+00,  -9.1870763948853652e-34,   1.3559069088471769e-35,   0.0000000000000000e+00,   0.0000000000000000e+00,   2.2204460492503131e-16,   0.0000000000000000e+00,  -2.5870202059762370e-07,  -1.1689389230094071e-05,   0.0000000000000000e+00,   0.0000000000000000e+00,   2.2204460492503131e-16,   0.0000000000000000e+00,   1.1869663491541514e-32,  -5.9696666554792304e-32,   0.0000000000000000e+00,
 			   5.6141618416296799e-05,   9.0931793960557659e-05,   9.7701826274227983e-04,  -1.3116204141036824e-08,  -4.6653654685127252e-05,   2.8804094111699839e-05,   8.0264943420907374e-12,   4.6784682013580646e-05,   7.5776494967131383e-05,   8.1418188561838156e-04,  -7.7756356855851488e-05,   4.8007055903198550e-05,  -7.3691866411124129e-20,   0.0000000000000000e+00,   0.0000000000000000e+00,   2.2204460492503131e-16,  -4.9471688275906347e-33,   7.3014527192763481e-35,   0.0000000000000000e+00,   0.0000000000000000e+00,   0.0000000000000000e+00,   2.2204460492503131e-16,  -1.4356660208780302e-06,   2.2244930832535674e-06,   0.0000000000000000e+00,   0.0000000000000000e+00,   0.0000000000000000e+00,   2.2204460492503131e-16,  -1.9372420316318850e-32,   1.1696638500100970e-32,   0.0000000000000000e+00,
@@ -126,14 +196,14 @@ void KalmanTestCase::test_add_features () {
 				1.0    //standar deviation for measurement noise
 		);
 
-	Eigen::MatrixXd new_uvds(2, 2);
-	new_uvds << 492, 131,
-	            160, 185;
+	std::vector<cv::Point2f> new_uvds;
+	new_uvds.push_back(cv::Point2f(492, 160));
+	new_uvds.push_back(cv::Point2f(131, 185));
 
 	//add the features to the filter (passing the point in undistorted homogeneous coordinates)
 	filter.add_features_inverse_depth( cam, new_uvds );
 
-	Eigen::VectorXd expected_x_k_k(43);
+	VectorXs expected_x_k_k(43);
 	expected_x_k_k <<    4.8894495233800118e-03,
 			  -2.4707966881481747e-03,
 			  -1.0727828539048055e-04,
@@ -178,7 +248,7 @@ void KalmanTestCase::test_add_features () {
 			  -4.1258552453447631e-02,
 			   1.0000000000000000e+00;
 
-	Eigen::MatrixXd expected_p_k_k(43, 43);
+	MatrixXs expected_p_k_k(43, 43);
 	expected_p_k_k << 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05, 5.9713611132931782e-07, 1.2535485862980017e-07,-2.3809897833383908e-04, 4.6598684589980987e-05, 4.3312309122472270e-04, 8.9461076674306406e-06, 4.6784682013580659e-05, 2.0773753339680045e-07,-3.9683549721766310e-04, 7.7665374815631287e-05, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 4.2416934220801014e-32,-6.2602520856492756e-34, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.2296567925249027e-05, 5.2946440742128997e-07, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.4104677658313671e-31,-7.8771967112281033e-35, 0.0000000000000000e+00, 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05,-4.7221274074927622e-04,-5.7007549327804902e-05, 0.0000000000000000e+00, 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05,-4.7888123598463538e-04, 6.8571212957373894e-05, 0.0000000000000000e+00
 			, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05,-3.0167768953372284e-07, 2.3822497118880750e-04,-1.2536269832262672e-07,-2.8770237373292349e-05, 8.9461076674306406e-06, 4.4208961743832025e-04, 7.5776494967131383e-05, 3.9704370889004608e-04,-2.0773753339735422e-07,-4.7950883262559406e-05, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-9.1870763948853652e-34, 1.3559069088471769e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-2.5870202059762370e-07,-1.1689389230094071e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 1.1869663491541514e-32,-5.9696666554792304e-32, 0.0000000000000000e+00, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05, 1.3429864770452319e-05, 4.1105226189518823e-04, 0.0000000000000000e+00, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05, 1.5690271665657561e-05, 2.7754858586679395e-04, 0.0000000000000000e+00
 			, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04,-1.3116204141036824e-08,-4.6653654685127252e-05, 2.8804094111699839e-05, 8.0264943420907374e-12, 4.6784682013580646e-05, 7.5776494967131383e-05, 8.1418188561838156e-04,-7.7756356855851488e-05, 4.8007055903198550e-05,-7.3691866411124129e-20, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-4.9471688275906347e-33, 7.3014527192763481e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-1.4356660208780302e-06, 2.2244930832535674e-06, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-1.9372420316318850e-32, 1.1696638500100970e-32, 0.0000000000000000e+00, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04, 5.4448168284071246e-05,-7.3583143318805950e-05, 0.0000000000000000e+00, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04, 5.4811672837366755e-05,-6.2625439408635757e-05, 0.0000000000000000e+00
@@ -223,12 +293,35 @@ void KalmanTestCase::test_add_features () {
 			, 6.8571212957373894e-05, 2.7754858586679395e-04,-6.2625439408635757e-05,-9.0356063447102393e-08, 1.9530939200721121e-04, 3.7748962087552683e-05, 3.8068459912100802e-04, 5.7142677464478223e-05, 2.3129048822232828e-04,-5.2187866173863144e-05, 3.2551705472994328e-04, 6.2915532662672721e-05, 6.3447662081468712e-04, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-1.6899428517738721e-17, 8.8083449141477326e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-1.7589115604459247e-06, 6.8459079077499756e-06, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-5.3922408799381151e-16, 6.4839803003420531e-17, 0.0000000000000000e+00, 6.8571212957373894e-05, 2.7754858586679395e-04,-6.2625439408635757e-05, 1.2153373511911500e-04,-1.6034690900799400e-04, 0.0000000000000000e+00, 6.8571212957373894e-05, 2.7754858586679395e-04,-6.2625439408635757e-05, 6.4910715181745721e-05, 8.3871066240722141e-04, 0.0000000000000000e+00
 			, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.0000000000000000e+00;
 
-	assert_state_covariance(filter.x_k_k(), expected_x_k_k, filter.p_k_k(), expected_p_k_k);
+	//The expected values above are of 6 value inverse depth features (x, y, z, theta, phi, rho), each one with its own copy of the
+	//anchor. New features share one anchor instead, stored before them (x, y, z, theta1, phi1, rho1, theta2, phi2, rho2), the same
+	//values without the second copy:
+	for (int i=0 ; i<3 ; i++){
+		CPPUNIT_ASSERT_EQUAL(expected_x_k_k(31 + i), expected_x_k_k(37 + i));
+	}
+	std::vector<int> anchored_positions;
+	for (int i=0 ; i<37 ; i++){
+		anchored_positions.push_back(i); //the previous state, the anchor and the first feature
+	}
+	for (int i=40 ; i<43 ; i++){
+		anchored_positions.push_back(i); //the second feature
+	}
+	const int size_anchored = anchored_positions.size();
+	VectorXs expected_anchored_x_k_k(size_anchored);
+	MatrixXs expected_anchored_p_k_k(size_anchored, size_anchored);
+	for (int i=0 ; i<size_anchored ; i++){
+		expected_anchored_x_k_k(i) = expected_x_k_k(anchored_positions[i]);
+		for (int j=0 ; j<size_anchored ; j++){
+			expected_anchored_p_k_k(i, j) = expected_p_k_k(anchored_positions[i], anchored_positions[j]);
+		}
+	}
+
+	assert_state_covariance(filter.x_k_k(), expected_anchored_x_k_k, filter.p_k_k(), expected_anchored_p_k_k);
 }
 
 void KalmanTestCase::test_delete_features () {
 
-	Eigen::VectorXd initial_x_k_k(37);
+	VectorXs initial_x_k_k(37);
 	initial_x_k_k << 1,
 			2,
 			3,
@@ -267,7 +360,7 @@ void KalmanTestCase::test_delete_features () {
 			36,
 			37;
 
-	Eigen::MatrixXd initial_p_k_k(37, 37); //cov matrix
+	MatrixXs initial_p_k_k(37, 37); //cov matrix
 	initial_p_k_k << 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,
 			2,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,
 			3,3,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,
@@ -312,16 +405,16 @@ void KalmanTestCase::test_delete_features () {
 				1.0    //standar deviation for measurement noise
 		);
 
-	std::vector<size_t> delete_list;
-
-	delete_list.push_back(0);
-	delete_list.push_back(2);
-	delete_list.push_back(3);
+	//Delete the features 0, 2 and 3:
+	std::vector<Features_extra> features_extra(4);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].is_valid = (i == 1);
+	}
 
-	//add the features to the filter (passing the point in undistorted homogeneous coordinates)
-	filter.delete_features( delete_list );
+	filter.delete_features( features_extra );
+	CPPUNIT_ASSERT_EQUAL((size_t)1, features_extra.size());
 
-	Eigen::VectorXd expected_x_k_k(19);
+	VectorXs expected_x_k_k(19);
 	expected_x_k_k << 1,
 			2,
 			3,
@@ -342,7 +435,7 @@ void KalmanTestCase::test_delete_features () {
 			24,
 			25;
 
-	Eigen::MatrixXd expected_p_k_k(19, 19);
+	MatrixXs expected_p_k_k(19, 19);
 	expected_p_k_k << 1,2,3,4,5,6,7,8,9,10,11,12,13,20,21,22,23,24,25,
 			2,2,3,4,5,6,7,8,9,10,11,12,13,20,21,22,23,24,25,
 			3,3,3,4,5,6,7,8,9,10,11,12,13,20,21,22,23,24,25,
@@ -366,16 +459,8 @@ void KalmanTestCase::test_delete_features () {
 	assert_state_covariance(filter.x_k_k(), expected_x_k_k, filter.p_k_k(), expected_p_k_k);
 }
 void KalmanTestCase::test_predict () {
-	//Initialize the camera parameters
-	Camera cam(0.0112,			   //d
-				342.5598894437880,  //Cx
-				173.0343808455040,  //Cy
-				0.0028450345588019, //k1
-				0.0000000000000222, //k2
-				2.1735   			//f
-		);
 
-	Eigen::VectorXd initial_x_k_k(43);
+	VectorXs initial_x_k_k(43);
 	initial_x_k_k << 4.8894495233800118e-03
 			,-2.4707966881481747e-03
 			,-1.0727828539048055e-04
@@ -420,7 +505,7 @@ void KalmanTestCase::test_predict () {
 			,-4.1258552453447631e-02
 			, 1.0000000000000000e+00;
 
-	Eigen::MatrixXd initial_p_k_k(43, 43); //cov matrix
+	MatrixXs initial_p_k_k(43, 43); //cov matrix
 	initial_p_k_k << 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05, 5.9713611132931782e-07, 1.2535485862980017e-07,-2.3809897833383908e-04, 4.6598684589980987e-05, 4.3312309122472270e-04, 8.9461076674306406e-06, 4.6784682013580659e-05, 2.0773753339680045e-07,-3.9683549721766310e-04, 7.7665374815631287e-05, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 4.2416934220801014e-32,-6.2602520856492756e-34, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.2296567925249027e-05, 5.2946440742128997e-07, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.4104677658313671e-31,-7.8771967112281033e-35, 0.0000000000000000e+00, 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05,-4.7221274074927622e-04,-5.7007549327804902e-05, 0.0000000000000000e+00, 5.1974770946988918e-04, 1.0735329200916772e-05, 5.6141618416296799e-05,-4.7888123598463538e-04, 6.8571212957373894e-05, 0.0000000000000000e+00
 			, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05,-3.0167768953372284e-07, 2.3822497118880750e-04,-1.2536269832262672e-07,-2.8770237373292349e-05, 8.9461076674306406e-06, 4.4208961743832025e-04, 7.5776494967131383e-05, 3.9704370889004608e-04,-2.0773753339735422e-07,-4.7950883262559406e-05, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-9.1870763948853652e-34, 1.3559069088471769e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-2.5870202059762370e-07,-1.1689389230094071e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 1.1869663491541514e-32,-5.9696666554792304e-32, 0.0000000000000000e+00, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05, 1.3429864770452319e-05, 4.1105226189518823e-04, 0.0000000000000000e+00, 1.0735329200916772e-05, 5.3050754092620633e-04, 9.0931793960557659e-05, 1.5690271665657561e-05, 2.7754858586679395e-04, 0.0000000000000000e+00
 			, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04,-1.3116204141036824e-08,-4.6653654685127252e-05, 2.8804094111699839e-05, 8.0264943420907374e-12, 4.6784682013580646e-05, 7.5776494967131383e-05, 8.1418188561838156e-04,-7.7756356855851488e-05, 4.8007055903198550e-05,-7.3691866411124129e-20, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-4.9471688275906347e-33, 7.3014527192763481e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-1.4356660208780302e-06, 2.2244930832535674e-06, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-1.9372420316318850e-32, 1.1696638500100970e-32, 0.0000000000000000e+00, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04, 5.4448168284071246e-05,-7.3583143318805950e-05, 0.0000000000000000e+00, 5.6141618416296799e-05, 9.0931793960557659e-05, 9.7701826274227983e-04, 5.4811672837366755e-05,-6.2625439408635757e-05, 0.0000000000000000e+00
@@ -472,7 +557,7 @@ void KalmanTestCase::test_predict () {
 				1.0    //standar deviation for measurement noise
 		);
 
-	Eigen::VectorXd expected_x_k_k(43);
+	VectorXs expected_x_k_k(43);
 	expected_x_k_k << 9.7788990467600218e-03
 			,-4.9415933762963484e-03
 			,-2.1455657078096109e-04
@@ -517,7 +602,7 @@ void KalmanTestCase::test_predict () {
 			,-4.1258552453447631e-02
 			, 1.0000000000000000e+00;
 
-	Eigen::MatrixXd expected_p_k_k(43, 43);
+	MatrixXs expected_p_k_k(43, 43);
 	expected_p_k_k << 2.1805972378788905e-03, 4.2941316803667075e-05, 2.2456647366518714e-04, 4.7770948665478230e-06, 5.0331900908892643e-07,-9.5238972666421013e-04, 1.8639329755835741e-04, 9.5091818244944545e-04, 1.7892215334861281e-05, 9.3569364027161305e-05, 4.1547506679359878e-07,-7.9367099443532609e-04, 1.5533074963126255e-04, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 8.4833868441602005e-32,-1.2520504171298548e-33, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.4593135850498046e-05, 1.0589288148425797e-06, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.8209355316627332e-31,-1.5754393422456168e-34, 0.0000000000000000e+00, 1.0394954189395563e-03, 2.1470658401833541e-05, 1.1228323683259357e-04,-9.4442548149855222e-04,-1.1401509865560978e-04, 0.0000000000000000e+00, 1.0394954189395563e-03, 2.1470658401833541e-05, 1.1228323683259357e-04,-9.5776247196927055e-04, 1.3714242591474776e-04, 0.0000000000000000e+00
 			, 4.2941316803667075e-05, 2.2236365637041591e-03, 3.6372717584223064e-04,-2.4134245353464685e-06, 9.5289654036232168e-04,-5.0337127376180894e-07,-1.1508016926684914e-04, 1.7892215334861281e-05, 9.6885123487664055e-04, 1.5155298993426277e-04, 7.9408741778009217e-04,-4.1547506679470871e-07,-9.5901766525118812e-05, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-1.8374152789770730e-33, 2.7118138176943533e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-5.1740404119524730e-07,-2.3378778460188142e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 2.3739326983083022e-32,-1.1939333310958461e-31, 0.0000000000000000e+00, 2.1470658401833541e-05, 1.0610150818521906e-03, 1.8186358792111532e-04, 2.6859729540904631e-05, 8.2210452379037646e-04, 0.0000000000000000e+00, 2.1470658401833541e-05, 1.0610150818521906e-03, 1.8186358792111532e-04, 3.1380543331315121e-05, 5.5509717173358791e-04, 0.0000000000000000e+00
 			, 2.2456647366518714e-04, 3.6372717584223064e-04, 4.0096794509684531e-03,-1.0492976439032514e-07,-1.8661419359764902e-04, 1.1521600463228310e-04, 5.3510018628013702e-11, 9.3569364027161291e-05, 1.5155298993426277e-04, 1.7130357712367632e-03,-1.5551271371170298e-04, 9.6014111806397100e-05,-1.4535085374883793e-19, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-9.8943376551812694e-33, 1.4602905438552694e-34, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-2.8713320417560604e-06, 4.4489861665071357e-06, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-3.8744840632637701e-32, 2.3393277000201940e-32, 0.0000000000000000e+00, 1.1228323683259358e-04, 1.8186358792111532e-04, 1.9540365254843376e-03, 1.0889633656814248e-04,-1.4716628663761193e-04, 0.0000000000000000e+00, 1.1228323683259358e-04, 1.8186358792111532e-04, 1.9540365254843376e-03, 1.0962334567473351e-04,-1.2525087881727154e-04, 0.0000000000000000e+00
@@ -569,16 +654,9 @@ void KalmanTestCase::test_predict () {
 }
 
 void KalmanTestCase::test_update() {
-	//Initialize the camera parameters
-	Camera cam(0.0112,			   //d
-			342.5598894437880,  //Cx
-			173.0343808455040,  //Cy
-			0.0028450345588019, //k1
-			0.0000000000000222, //k2
-			2.1735   			//f
-	);
+	Camera cam = sample_camera();
 
-	Eigen::VectorXd initial_x_k_k(43);
+	VectorXs initial_x_k_k(43);
 	initial_x_k_k << 9.7788990467600218e-03
 			,-4.9415933762963484e-03
 			,-2.1455657078096109e-04
@@ -623,7 +701,7 @@ void KalmanTestCase::test_update() {
 			,-4.1258552453447631e-02
 			, 1.0000000000000000e+00;
 
-	Eigen::MatrixXd initial_p_k_k(43, 43); //cov matrix
+	MatrixXs initial_p_k_k(43, 43); //cov matrix
 	initial_p_k_k << 2.1805972378788905e-03, 4.2941316803667075e-05, 2.2456647366518714e-04, 4.7770948665478230e-06, 5.0331900908892643e-07,-9.5238972666421013e-04, 1.8639329755835741e-04, 9.5091818244944545e-04, 1.7892215334861281e-05, 9.3569364027161305e-05, 4.1547506679359878e-07,-7.9367099443532609e-04, 1.5533074963126255e-04, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 8.4833868441602005e-32,-1.2520504171298548e-33, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.4593135850498046e-05, 1.0589288148425797e-06, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.8209355316627332e-31,-1.5754393422456168e-34, 0.0000000000000000e+00, 1.0394954189395563e-03, 2.1470658401833541e-05, 1.1228323683259357e-04,-9.4442548149855222e-04,-1.1401509865560978e-04, 0.0000000000000000e+00, 1.0394954189395563e-03, 2.1470658401833541e-05, 1.1228323683259357e-04,-9.5776247196927055e-04, 1.3714242591474776e-04, 0.0000000000000000e+00
 			, 4.2941316803667075e-05, 2.2236365637041591e-03, 3.6372717584223064e-04,-2.4134245353464685e-06, 9.5289654036232168e-04,-5.0337127376180894e-07,-1.1508016926684914e-04, 1.7892215334861281e-05, 9.6885123487664055e-04, 1.5155298993426277e-04, 7.9408741778009217e-04,-4.1547506679470871e-07,-9.5901766525118812e-05, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-1.8374152789770730e-33, 2.7118138176943533e-35, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-5.1740404119524730e-07,-2.3378778460188142e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 2.3739326983083022e-32,-1.1939333310958461e-31, 0.0000000000000000e+00, 2.1470658401833541e-05, 1.0610150818521906e-03, 1.8186358792111532e-04, 2.6859729540904631e-05, 8.2210452379037646e-04, 0.0000000000000000e+00, 2.1470658401833541e-05, 1.0610150818521906e-03, 1.8186358792111532e-04, 3.1380543331315121e-05, 5.5509717173358791e-04, 0.0000000000000000e+00
 			, 2.2456647366518714e-04, 3.6372717584223064e-04, 4.0096794509684531e-03,-1.0492976439032514e-07,-1.8661419359764902e-04, 1.1521600463228310e-04, 5.3510018628013702e-11, 9.3569364027161291e-05, 1.5155298993426277e-04, 1.7130357712367632e-03,-1.5551271371170298e-04, 9.6014111806397100e-05,-1.4535085374883793e-19, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-9.8943376551812694e-33, 1.4602905438552694e-34, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-2.8713320417560604e-06, 4.4489861665071357e-06, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-3.8744840632637701e-32, 2.3393277000201940e-32, 0.0000000000000000e+00, 1.1228323683259358e-04, 1.8186358792111532e-04, 1.9540365254843376e-03, 1.0889633656814248e-04,-1.4716628663761193e-04, 0.0000000000000000e+00, 1.1228323683259358e-04, 1.8186358792111532e-04, 1.9540365254843376e-03, 1.0962334567473351e-04,-1.2525087881727154e-04, 0.0000000000000000e+00
@@ -675,7 +753,7 @@ void KalmanTestCase::test_update() {
 			1.0    //standar deviation for measurement noise
 	);
 
-	Eigen::VectorXd expected_x_k_k(43);
+	VectorXs expected_x_k_k(43);
 	expected_x_k_k << 1.5259070151413427e-02
 			,-4.2363364034027264e-04
 			,-6.0039318684112393e-03
@@ -720,7 +798,7 @@ void KalmanTestCase::test_update() {
 			,-4.3130656337015912e-02
 			, 1.0000000000000000e+00;
 
-	Eigen::MatrixXd expected_p_k_k(43, 43);
+	MatrixXs expected_p_k_k(43, 43);
 	expected_p_k_k << 1.9647721975280530e-03,-8.8580627634130495e-05,-3.7948362746768470e-04, 8.0328290477076499e-06, 5.0169134829363159e-06,-9.4627006738229205e-04, 1.0028762389729710e-04, 8.4827861592751781e-04,-4.5750233023255315e-05,-1.6776206962417203e-04, 1.0904695603986615e-05,-7.9677259546917924e-04, 8.0896785460744249e-05, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00,-1.1939071194298047e-18, 1.4107417880191369e-18, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.9256886791699446e-05, 4.7966777233113116e-06,-6.7105473270533383e-03, 2.2204460492503131e-16, 0.0000000000000000e+00, 0.0000000000000000e+00,-1.9556948293345782e-18,-1.9210331378670943e-18, 0.0000000000000000e+00, 9.4683785841503173e-04,-3.3680348006224074e-05,-1.7816914391867843e-04,-9.3649413349269504e-04,-7.1690099372808267e-05, 2.4275409492036924e-03, 9.4683785841503173e-04,-3.3680348006224074e-05,-1.7816914391867843e-04,-9.3958456192229833e-04, 7.3466029414975275e-05, 0.0000000000000000e+00
 			,-8.8580627634130495e-05, 2.0062260816604122e-03,-2.2834353896670871e-05,-8.2937061321891129e-07, 9.5068914327246269e-04,-7.0017175237239253e-07,-3.5020049366235904e-04,-3.7726116348936159e-05, 8.5030388378766161e-04,-1.2867808264006557e-05, 8.1602790112467790e-04, 6.6340516473772934e-07,-3.0455424318966135e-04, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-5.9656970429047954e-19, 2.7628456140982380e-18, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00, 6.2123672048048376e-07,-8.8098888622197303e-06,-5.9722526794872902e-04, 0.0000000000000000e+00, 2.2204460492503131e-16, 0.0000000000000000e+00,-2.1323152403796349e-18,-2.5750612033052953e-18, 0.0000000000000000e+00,-4.3309288015407071e-05, 9.8586142111521864e-04,-7.3929839798631111e-06, 1.3130110975689592e-05, 9.2431017306947847e-04, 1.8444634038760465e-03,-4.3309288015407071e-05, 9.8586142111521864e-04,-7.3929839798631111e-06, 3.5100360640318389e-05, 3.7177711313841384e-04, 0.0000000000000000e+00
 			,-3.7948362746768470e-04,-2.2834353896670871e-05, 1.2419773609108936e-03,-2.8768182825701118e-06,-7.9072993599454874e-05, 3.6081446836157684e-04, 2.9521744441930132e-05,-1.3614381171442712e-04,-2.6413132581517589e-05, 5.0240681443736287e-04,-5.2893152539648403e-05, 3.4429725822223919e-04, 1.8109192086443894e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-6.1975396135657559e-18,-1.2076878342966372e-18, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16, 1.8726130018260416e-05, 1.0602899987961395e-05,-1.4041488744205674e-02, 0.0000000000000000e+00, 0.0000000000000000e+00, 2.2204460492503131e-16,-5.3663371249590781e-18,-3.2049998971283959e-18, 0.0000000000000000e+00,-2.1611105341037265e-04, 8.8614052011503925e-06, 6.3908918358605816e-04, 2.8331395974569008e-04,-1.1126392613340171e-04, 1.0690339813187046e-02,-2.1611105341037265e-04, 8.8614052011503925e-06, 6.3908918358605816e-04, 3.0459122457031666e-04,-3.5648609502914090e-05, 0.0000000000000000e+00
@@ -765,16 +843,490 @@ void KalmanTestCase::test_update() {
 			, 7.3466029414975275e-05, 3.7177711313841384e-04,-3.5648609502914090e-05, 4.7361753412292902e-07, 2.1090490739186153e-04,-2.2832124277200138e-05, 7.9338378209425981e-05, 2.6840540413349559e-05, 1.4538139104338830e-04,-1.1589131226227103e-05, 1.7459703476686736e-04,-2.5576293714892435e-05, 3.8723689111033537e-05, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-1.7263713467569956e-17, 8.7681117797305980e-16, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-3.3436254836263282e-06, 1.0413854190464072e-05,-4.3584395232404557e-04, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00,-5.3732148940449457e-16, 6.7763662009378952e-17, 0.0000000000000000e+00, 4.1257380918956176e-05, 1.9731944388634784e-04,-2.1741652031441583e-05, 3.1710963698688049e-06, 8.0694806752658557e-05, 3.3014900142913899e-04, 4.1257380918956176e-05, 1.9731944388634784e-04,-2.1741652031441583e-05,-1.2206243355965985e-05, 2.3814219137893006e-04, 0.0000000000000000e+00
 			, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 0.0000000000000000e+00, 1.0000000000000000e+00;
 
-	std::vector<cv::Point2f> observations;
-	observations.push_back(cv::Point2f(359, 211));
-	observations.push_back(cv::Point2f(486, 160));
+	std::vector<Features_extra> features_extra;
+	filter.compute_features_h(cam, features_extra);
 
-	filter.update(cam, observations);
+	//Only the features 1 and 3 are observed (next to their predictions, 362x213 and 489x161):
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].is_valid = false;
+	}
+	features_extra[1].is_valid = true;
+	features_extra[1].z << 359, 211;
+	features_extra[3].is_valid = true;
+	features_extra[3].z << 486, 160;
+
+	filter.update(features_extra);
 
 	assert_state_covariance(filter.x_k_k(), expected_x_k_k, filter.p_k_k(), expected_p_k_k);
 }
 
-void KalmanTestCase::assert_state_covariance(const Eigen::VectorXd & computed_x_k_k, const Eigen::VectorXd & expected_x_k_k, const Eigen::MatrixXd & computed_p_k_k, const Eigen::MatrixXd & expected_p_k_k){
+void KalmanTestCase::test_covariance_stays_positive_semidefinite() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter = filter_with_features(cam, 20);
+
+	//Several predictions and updates with biased observations, where the round-off of the covariance correction accumulates:
+	for (int step=0 ; step<10 ; step++){
+		std::vector<Features_extra> features_extra;
+		filter.predict_state_and_covariance(1.0);
+		filter.compute_features_h(cam, features_extra);
+		for (size_t i=0 ; i<features_extra.size() ; i++){
+			features_extra[i].z = features_extra[i].h + Vector2s(0.5, -0.3);
+			features_extra[i].z_cv = cv::Point2f(features_extra[i].z(0), features_extra[i].z(1));
+		}
+		filter.update(features_extra);
+
+		const MatrixXs p_k_k = filter.p_k_k();
+		for (int i=0 ; i<p_k_k.rows() ; i++)
+			for (int j=0 ; j<i ; j++)
+				CPPUNIT_ASSERT_EQUAL(p_k_k(i, j), p_k_k(j, i));
+
+		//The initial camera pose is known exactly, so p_k_k is only positive semi-definite (up to round-off):
+		const VectorXs eigenvalues = Eigen::SelfAdjointEigenSolver<MatrixXs>(p_k_k).eigenvalues();
+		CPPUNIT_ASSERT(eigenvalues.minCoeff() > -1e-5*eigenvalues.maxCoeff());
+	}
+}
+
+void KalmanTestCase::test_evict_features() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter = filter_with_features(cam, 20);
+	FeatureEvictionOldest eviction_policy;
+	filter.set_max_features(15, &eviction_policy);
+
+	std::vector<Features_extra> features_extra;
+	filter.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+
+	//The 5 oldest features are over the limit:
+	CPPUNIT_ASSERT_EQUAL((size_t)20, features_extra.size());
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		CPPUNIT_ASSERT_EQUAL(i >= 5, features_extra[i].is_valid);
+	}
+
+	filter.delete_features(features_extra);
+	CPPUNIT_ASSERT_EQUAL((size_t)15, features_extra.size());
+	CPPUNIT_ASSERT_EQUAL(13 + 3 + 15*3, (int)filter.x_k_k().rows()); //their shared anchor stays
+
+	//At the limit, new features are not added until some are deleted, and then only as many as fit:
+	std::vector<cv::Point2f> new_features(3, cv::Point2f(100, 200));
+	CPPUNIT_ASSERT_EQUAL(0, filter.add_features_inverse_depth(cam, new_features));
+	CPPUNIT_ASSERT_EQUAL(13 + 3 + 15*3, (int)filter.x_k_k().rows());
+
+	features_extra[0].is_valid = false;
+	filter.delete_features(features_extra);
+	CPPUNIT_ASSERT_EQUAL(1, filter.add_features_inverse_depth(cam, new_features));
+	CPPUNIT_ASSERT_EQUAL(13 + 3 + 14*3 + 3 + 3, (int)filter.x_k_k().rows());
+}
+
+void KalmanTestCase::test_convert_features_to_cartesian() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter = filter_with_features(cam, 20);
+
+	//Same filter, one switching every feature to Cartesian after the update and the other one never:
+	Kalman filter_cartesian = filter;
+	filter_cartesian.set_cartesian_linearity_threshold(1e9);
+
+	std::vector<Features_extra> features_extra;
+	std::vector<Features_extra> features_extra_cartesian;
+	filter.predict_state_and_covariance(1.0);
+	filter_cartesian.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	filter_cartesian.compute_features_h(cam, features_extra_cartesian);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].z = features_extra[i].h + Vector2s(0.5, -0.3);
+		features_extra_cartesian[i].z = features_extra[i].z;
+	}
+	filter.update(features_extra);
+	filter_cartesian.update(features_extra_cartesian);
+
+	std::vector<Features_extra> layout;
+	filter_cartesian.features_layout(layout);
+	CPPUNIT_ASSERT_EQUAL((size_t)20, layout.size());
+	CPPUNIT_ASSERT_EQUAL(13 + 20*3, (int)filter_cartesian.x_k_k().rows()); //without their anchor
+
+	//Both represent the same points, so they predict the same observations:
+	features_extra.clear();
+	features_extra_cartesian.clear();
+	filter.compute_features_h(cam, features_extra);
+	filter_cartesian.compute_features_h(cam, features_extra_cartesian);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		CPPUNIT_ASSERT_EQUAL(Feature::CARTESIAN, layout[i].parametrization);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(features_extra[i].h(0), features_extra_cartesian[i].h(0), 1e-3);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(features_extra[i].h(1), features_extra_cartesian[i].h(1), 1e-3);
+	}
+}
+
+void KalmanTestCase::test_anchored_homogeneous_features() {
+	Camera cam = ardrone_camera();
+
+	//The same features as anchored inverse depth (default) and as anchored homogeneous points:
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	Kalman filter_homogeneous(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	filter_homogeneous.set_new_features_parametrization(Feature::ANCHORED_HOMOGENEOUS);
+
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<20 ; i++){
+		new_features.push_back(cv::Point2f(60 + 25*i, 40 + 13*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+	filter_homogeneous.add_features_inverse_depth(cam, new_features);
+	CPPUNIT_ASSERT_EQUAL(13 + 3 + 20*4, (int)filter_homogeneous.x_k_k().rows());
+
+	//Both represent the same points with the same uncertainty, so they predict the same observations and get the same correction:
+	std::vector<Features_extra> features_extra;
+	std::vector<Features_extra> features_extra_homogeneous;
+	filter.predict_state_and_covariance(1.0);
+	filter_homogeneous.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	filter_homogeneous.compute_features_h(cam, features_extra_homogeneous);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		CPPUNIT_ASSERT_EQUAL(Feature::ANCHORED_HOMOGENEOUS, features_extra_homogeneous[i].parametrization);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(features_extra[i].h(0), features_extra_homogeneous[i].h(0), 1e-3);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(features_extra[i].h(1), features_extra_homogeneous[i].h(1), 1e-3);
+		features_extra[i].z = features_extra[i].h + Vector2s(0.5, -0.3);
+		features_extra_homogeneous[i].z = features_extra[i].z;
+	}
+	filter.update(features_extra);
+	filter_homogeneous.update(features_extra_homogeneous);
+
+	for (int i=0 ; i<13 ; i++){
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(filter.x_k_k()(i), filter_homogeneous.x_k_k()(i), delta_);
+	}
+}
+
+void KalmanTestCase::test_batch_projection() {
+	Camera cam = ardrone_camera();
+
+	const Vector3s rW(0.1, -0.05, 0.2);
+	const Vector4s qWR = Vector4s(0.99, 0.05, -0.08, 0.03).normalized();
+	Matrix3s qWR_rotation_matrix;
+	MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
+
+	//A feature of each size: inverse depth, anchored homogeneous and Cartesian
+	std::vector<VectorXs> features;
+	for (int i=0 ; i<9 ; i++){
+		const ekf_scalar offset = 0.05*i;
+		VectorXs yi(Feature::INVERSE_DEPTH_SIZE);
+		yi << 0.01, 0.02, -0.01, -0.3 + offset, 0.2 - offset, 0.5 + offset;
+		if (i%3 == 1){
+			yi.resize(Feature::HOMOGENEOUS_SIZE);
+			yi << 0.01, 0.02, -0.01, -0.3 + offset, 0.2 - offset, 1.0, 0.4 + offset;
+		} else if (i%3 == 2){
+			yi.resize(Feature::CARTESIAN_SIZE);
+			yi << -0.5 + offset, 0.3 - offset, 3.0 + offset;
+		}
+		features.push_back(yi);
+	}
+
+	//The batch has to give the same h as the scalar path:
+	FeatureProjections projections;
+	projections.resize(features.size());
+	for (size_t i=0 ; i<features.size() ; i++){
+		Feature::set_lane(features[i], projections, i);
+	}
+	Feature::project(cam, rW, qWR_rotation_matrix, projections);
+
+	for (size_t i=0 ; i<features.size() ; i++){
+		Vector2s hi;
+		Feature::compute_h(cam, rW, qWR_rotation_matrix, features[i], hi);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(hi(0), projections.u(i), delta_);
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(hi(1), projections.v(i), delta_);
+	}
+}
+
+void KalmanTestCase::test_distortion_table() {
+	const ekf_scalar max_error = 0.01; //pixels
+	Camera cam = ardrone_camera();
+	Camera cam_table(588.878779108602, 588.643674196636, 303.725019622098, 185.837132396075, -0.550446697998159, 0.311341231340524, max_error);
+
+	//Over the image (and outside it, where the table is not used), distort has to stay within max_error of the Newton iterations:
+	for (int u=-100 ; u<=700 ; u+=20){
+		for (int v=-100 ; v<=480 ; v+=20){
+			Vector2s uvd, uvd_table;
+			cam.distort(Vector2s(u, v), uvd);
+			cam_table.distort(Vector2s(u, v), uvd_table);
+			CPPUNIT_ASSERT((uvd - uvd_table).norm() <= max_error);
+		}
+	}
+
+	//and be the inverse of undistort:
+	Vector2s uvu, uvd;
+	cam_table.undistort(Vector2s(40, 30), uvu);
+	cam_table.distort(uvu, uvd);
+	CPPUNIT_ASSERT((uvd - Vector2s(40, 30)).norm() <= max_error);
+}
+
+void KalmanTestCase::test_fisheye_camera() {
+	FisheyeCamera cam(300, 302, 320, 240);
+
+	for (int u=0 ; u<=640 ; u+=40){
+		for (int v=0 ; v<=480 ; v+=40){
+			//distort has to be the inverse of undistort:
+			const Vector2s uvd(u + 0.5, v + 0.5);
+			Vector2s uvu, uvd_back;
+			cam.undistort(uvd, uvu);
+			cam.distort(uvu, uvd_back);
+			CPPUNIT_ASSERT_DOUBLES_EQUAL(uvd(0), uvd_back(0), delta_);
+			CPPUNIT_ASSERT_DOUBLES_EQUAL(uvd(1), uvd_back(1), delta_);
+
+			//and jacob_undistort its derivative (central differences):
+			Matrix2s UVU_uvd;
+			cam.jacob_undistort(uvd, UVU_uvd);
+			for (int j=0 ; j<2 ; j++){
+				const Vector2s step = Vector2s::Unit(j)*1e-1;
+				Vector2s uvu_plus, uvu_minus;
+				cam.undistort(uvd + step, uvu_plus);
+				cam.undistort(uvd - step, uvu_minus);
+				const Vector2s derivative = (uvu_plus - uvu_minus)/2e-1;
+				CPPUNIT_ASSERT_DOUBLES_EQUAL(derivative(0), UVU_uvd(0, j), 1e-2*std::max<ekf_scalar>(1, fabs(derivative(0))));
+				CPPUNIT_ASSERT_DOUBLES_EQUAL(derivative(1), UVU_uvd(1, j), 1e-2*std::max<ekf_scalar>(1, fabs(derivative(1))));
+			}
+		}
+	}
+}
+
+void KalmanTestCase::test_innovation_covariance() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	filter.set_cartesian_linearity_threshold(0.1);
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<10 ; i++){
+		new_features.push_back(cv::Point2f(60 + 45*i, 40 + 25*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+
+	//The S of each feature (the tracker search region) has to be the one of the dense H:
+	std::vector<Features_extra> features_extra;
+	filter.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	const int size_x = filter.x_k_k().rows();
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		MatrixXs H = MatrixXs::Zero(2, size_x);
+		H.leftCols<13>() = features_extra[i].H_xv;
+		H.middleCols(features_extra[i].yi_start_pos, features_extra[i].yi_size) = features_extra[i].H_yi.leftCols(features_extra[i].yi_size);
+		if (features_extra[i].anchor_start_pos >= 0){
+			H.middleCols<3>(features_extra[i].anchor_start_pos) = features_extra[i].H_anchor;
+		}
+		MatrixXs S = H*filter.p_k_k()*H.transpose();
+		S.diagonal().array() += 1.0; //std_z^2
+
+		CPPUNIT_ASSERT(features_extra[i].is_valid);
+		for (int j=0 ; j<4 ; j++){
+			CPPUNIT_ASSERT_DOUBLES_EQUAL(S(j), features_extra[i].S(j), delta_*S.norm());
+		}
+	}
+}
+
+void KalmanTestCase::test_sequential_update() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter = filter_with_features(cam, 20);
+
+	std::vector<Features_extra> features_extra;
+	filter.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].z = features_extra[i].h + Vector2s(0.5 - 0.2*(i%5), -0.3 + 0.1*(i%3));
+	}
+	features_extra[7].is_valid = false; //not observed
+
+	//All the observations are linearised at the same predicted state, so one at a time gives the same result as all at once:
+	Kalman filter_sequential = filter;
+	filter_sequential.set_update_mode(Kalman::UPDATE_SEQUENTIAL);
+	std::vector<Features_extra> features_extra_sequential = features_extra;
+
+	filter.update(features_extra);
+	filter_sequential.update(features_extra_sequential);
+	CPPUNIT_ASSERT_EQUAL(19, filter.last_update_observations());
+	CPPUNIT_ASSERT_EQUAL(19, filter_sequential.last_update_observations());
+
+	assert_state_covariance(filter_sequential.x_k_k(), filter.x_k_k(), filter_sequential.p_k_k(), filter.p_k_k());
+}
+
+void KalmanTestCase::test_update_time_budget() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter = filter_with_features(cam, 20);
+	filter.set_update_mode(Kalman::UPDATE_SEQUENTIAL);
+	filter.set_update_time_budget(0);
+
+	std::vector<Features_extra> features_extra;
+	filter.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].z = features_extra[i].h + Vector2s(0.5, -0.3);
+	}
+
+	const VectorXs x_k_k = filter.x_k_k();
+	const MatrixXs p_k_k = filter.p_k_k();
+	filter.update(features_extra);
+	CPPUNIT_ASSERT_EQUAL(0, filter.last_update_observations());
+
+	//The budget runs out before the first observation, so the state is not corrected. Only the orientation rows and columns of the
+	//covariance change (the quaternion normalisation after the update):
+	const int size_x = x_k_k.rows();
+	for (int i=0 ; i<size_x ; i++){
+		CPPUNIT_ASSERT_DOUBLES_EQUAL(x_k_k(i), filter.x_k_k()(i), delta_);
+	}
+	for (int i=0 ; i<size_x ; i++){
+		for (int j=0 ; j<size_x ; j++){
+			if ((i < 3 || i >= 7) && (j < 3 || j >= 7)){
+				CPPUNIT_ASSERT_DOUBLES_EQUAL(p_k_k(i, j), filter.p_k_k()(i, j), 1e-10); //up to the symmetrisation round-off
+			}
+		}
+	}
+}
+
+void KalmanTestCase::test_reuse_feature_slots() {
+	Camera cam = ardrone_camera();
+
+	//The same features with room reserved for 30 of them, and without (its storage grows when it needs to):
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	filter.reserve_features(30);
+	Kalman filter_unreserved(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<20 ; i++){
+		new_features.push_back(cv::Point2f(60 + 25*i, 40 + 13*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+	filter_unreserved.add_features_inverse_depth(cam, new_features);
+	const ekf_scalar * x_k_k_storage = filter.x_k_k().data();
+	const ekf_scalar * p_k_k_storage = filter.p_k_k().data();
+
+	//Delete every other feature, then add as many again:
+	std::vector<Features_extra> features_extra;
+	std::vector<Features_extra> features_extra_unreserved;
+	filter.predict_state_and_covariance(1.0);
+	filter_unreserved.predict_state_and_covariance(1.0);
+	filter.compute_features_h(cam, features_extra);
+	filter_unreserved.compute_features_h(cam, features_extra_unreserved);
+	for (size_t i=0 ; i<features_extra.size() ; i++){
+		features_extra[i].is_valid = features_extra_unreserved[i].is_valid = (i%2 == 0);
+	}
+	filter.delete_features(features_extra);
+	filter_unreserved.delete_features(features_extra_unreserved);
+	CPPUNIT_ASSERT_EQUAL((size_t)10, features_extra.size());
+
+	new_features.resize(10);
+	for (int i=0 ; i<10 ; i++){
+		new_features[i] = cv::Point2f(70 + 50*i, 300 - 20*i);
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+	filter_unreserved.add_features_inverse_depth(cam, new_features);
+
+	//The new features took the freed slots, the storage was not reallocated:
+	CPPUNIT_ASSERT_EQUAL(13 + 3 + 10*3 + 3 + 10*3, (int)filter.x_k_k().rows());
+	CPPUNIT_ASSERT(filter.x_k_k().data() == x_k_k_storage);
+	CPPUNIT_ASSERT(filter.p_k_k().data() == p_k_k_storage);
+
+	assert_state_covariance(filter.x_k_k(), filter_unreserved.x_k_k(), filter.p_k_k(), filter_unreserved.p_k_k());
+}
+
+void KalmanTestCase::test_add_features_batch() {
+	Camera cam = ardrone_camera();
+
+	//Some features and a prediction first, so that the camera is uncertain and correlated with them:
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<10 ; i++){
+		new_features.push_back(cv::Point2f(60 + 50*i, 40 + 26*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+	filter.predict_state_and_covariance(1.0);
+	const int size_before = filter.x_k_k().rows();
+
+	//The same 5 features, all at once and one at a time:
+	Kalman filter_one_by_one = filter;
+	new_features.clear();
+	for (int i=0 ; i<5 ; i++){
+		new_features.push_back(cv::Point2f(100 + 90*i, 300 - 45*i));
+		filter_one_by_one.add_features_inverse_depth(cam, std::vector<cv::Point2f>(1, new_features[i]));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+
+	//Added one at a time, each feature gets its own copy of the anchor (anchor, feature, anchor, feature...). Without the copies
+	//it is the state and covariance of the shared anchor layout (anchor, feature, feature...):
+	std::vector<int> shared_anchor_positions;
+	for (int i=0 ; i<size_before+3 ; i++){
+		shared_anchor_positions.push_back(i); //the previous state and the first anchor
+	}
+	for (int p=0 ; p<5 ; p++){
+		for (int i=0 ; i<3 ; i++){
+			CPPUNIT_ASSERT_EQUAL(filter_one_by_one.x_k_k()(size_before + i), filter_one_by_one.x_k_k()(size_before + 6*p + i));
+			shared_anchor_positions.push_back(size_before + 6*p + 3 + i);
+		}
+	}
+	const int size_after = shared_anchor_positions.size();
+	VectorXs expected_x_k_k(size_after);
+	MatrixXs expected_p_k_k(size_after, size_after);
+	for (int i=0 ; i<size_after ; i++){
+		expected_x_k_k(i) = filter_one_by_one.x_k_k()(shared_anchor_positions[i]);
+		for (int j=0 ; j<size_after ; j++){
+			expected_p_k_k(i, j) = filter_one_by_one.p_k_k()(shared_anchor_positions[i], shared_anchor_positions[j]);
+		}
+	}
+
+	assert_state_covariance(filter.x_k_k(), expected_x_k_k, filter.p_k_k(), expected_p_k_k);
+}
+
+#if defined(EKFOA_MAX_FEATURES) && defined(EIGEN_RUNTIME_NO_MALLOC)
+/*
+ * With EKFOA_MAX_FEATURES nothing the filter does on each frame may allocate on the heap, once it has run a first frame (Eigen
+ * asserts on any allocation while it is not allowed).
+ */
+void KalmanTestCase::test_no_heap_allocation() {
+	Camera cam = ardrone_camera();
+
+	Kalman filter(0.0, 0.025, 1e-15, 0.025, 0.007, 0.007, 1.0);
+	FeatureEvictionFlightPath eviction_policy;
+	filter.set_max_features(20, &eviction_policy);
+	filter.set_cartesian_linearity_threshold(0.1);
+
+	std::vector<cv::Point2f> new_features;
+	for (int i=0 ; i<24 ; i++){
+		new_features.push_back(cv::Point2f(60 + 20*i, 40 + 11*i));
+	}
+	filter.add_features_inverse_depth(cam, new_features);
+
+	//Every frame: the features over the limit are evicted, one is lost, the rest are observed, and as many new ones are added
+	//(inverse depth and anchored homogeneous features in turn, so both are projected). The update is batch and sequential in turn:
+	std::vector<Features_extra> features_extra;
+	features_extra.reserve(EKFOA_MAX_FEATURES);
+	new_features.reserve(EKFOA_MAX_FEATURES);
+	for (int frame=0 ; frame<6 ; frame++){
+		if (frame == 1){
+			Eigen::internal::set_is_malloc_allowed(false);
+		}
+		filter.set_new_features_parametrization(frame%2 ? Feature::ANCHORED_HOMOGENEOUS : Feature::ANCHORED_INVERSE_DEPTH);
+		filter.set_update_mode(frame%2 ? Kalman::UPDATE_SEQUENTIAL : Kalman::UPDATE_BATCH);
+
+		filter.predict_state_and_covariance(1.0/30);
+		filter.compute_features_h(cam, features_extra);
+		const size_t num_features = features_extra.size();
+		features_extra[frame].is_valid = false;
+		for (size_t i=0 ; i<num_features ; i++){
+			features_extra[i].z = features_extra[i].h + Vector2s(0.5 - 0.2*(i%5), -0.3 + 0.1*(i%3));
+		}
+		filter.delete_features(features_extra);
+		filter.update(features_extra);
+
+		new_features.resize(num_features - features_extra.size());
+		for (size_t i=0 ; i<new_features.size() ; i++){
+			new_features[i] = cv::Point2f(100 + 30*i, 60 + 17*i + 5*frame);
+		}
+		filter.add_features_inverse_depth(cam, new_features);
+	}
+	Eigen::internal::set_is_malloc_allowed(true);
+
+	CPPUNIT_ASSERT(filter.p_k_k().allFinite());
+}
+#endif
+
+void KalmanTestCase::assert_state_covariance(const VectorXs & computed_x_k_k, const VectorXs & expected_x_k_k, const MatrixXs & computed_p_k_k, const MatrixXs & expected_p_k_k){
 	CPPUNIT_ASSERT_EQUAL (expected_x_k_k.rows(), computed_x_k_k.rows());
 	CPPUNIT_ASSERT_EQUAL (expected_x_k_k.cols(), computed_x_k_k.cols());
 	CPPUNIT_ASSERT_EQUAL (expected_p_k_k.rows(), computed_p_k_k.rows());
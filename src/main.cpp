@@ -2,7 +2,9 @@
 #include <boost/thread.hpp>   // boost::thread
 
 #include "ekfoa.hpp"
+#ifndef EKFOA_HEADLESS
 #include "gui.hpp"
+#endif
 
 #include <opencv2/highgui/highgui.hpp> //imread
 
@@ -23,8 +25,10 @@ void ekfoa(){
 
 	char file_path[255]; // enough to hold all numbers up to 64-bits
 
+#ifndef EKFOA_HEADLESS
 	cv::namedWindow("Camera input", cv::WINDOW_AUTOSIZE );
 	cv::moveWindow("Camera input", 1040, 0);
+#endif
 
 	Eigen::Matrix3d axes_orientation_and_confidence;
 	std::list<Eigen::Vector3d> trajectory;
@@ -37,7 +41,8 @@ void ekfoa(){
 
 //		sprintf(file_path, "%s%04d.pgm", sequence_prefix.c_str(), step);
 		sprintf(file_path, "%s%03d.png", sequence_prefix.c_str(), step);
-		frame = cv::imread(file_path, CV_LOAD_IMAGE_COLOR);   // Read the file
+		//The filter only needs the intensity, the color is only for the overlay:
+		frame = cv::imread(file_path, CV_LOAD_IMAGE_GRAYSCALE);   // Read the file
 
 		Delaunay triangulation;
 		Point3d closest_point;
@@ -70,16 +75,29 @@ void ekfoa(){
 //		std::cout << "a: " << a << std::endl;
 //		std::cout << "b: " << b << std::endl;
 
-		//Show the processed frame:
-		cv::imshow("Camera input", frame);
+#ifndef EKFOA_HEADLESS
+		//Show the processed frame, with the tracker and triangulation overlay:
+		cv::Mat overlay;
+		cv::cvtColor(frame, overlay, CV_GRAY2BGR);
+		ekfoa.draw(overlay, triangulation);
+		cv::imshow("Camera input", overlay);
 
 		Gui::update_draw_parameters(trajectory, orientation, axes_orientation_and_confidence, XYZs, triangulation, closest_point);
 		//PAUSE:
 		std::cin.ignore(1);
+#endif
 	}
+
+	const MotionTrackerOF::VerificationStats & verification = ekfoa.tracker().verification_stats();
+	std::cout << "forward-backward verification: " << verification.verified << " features tracked back, " << verification.skipped
+			<< " skipped (" << verification.fallbacks << " fallbacks)" << std::endl;
 }
 
 int main(int argc, char** argv){
+#ifdef EKFOA_HEADLESS
+	//No windows, the filter runs in this thread:
+	ekfoa();
+#else
 	//initialize the OpenGL gui:
 	Gui::init();
 
@@ -94,5 +112,6 @@ int main(int argc, char** argv){
     ekfoa_thread.join();
 
 	Gui::release();
+#endif
 }
 
@@ -1,39 +1,58 @@
 #include "motion_model.hpp"
 
-void MotionModel::prediction_step(const double delta_t, const double std_a, const double std_alpha, Eigen::VectorXd & x_k_k, Eigen::MatrixXd & F, Eigen::MatrixXd & Q){
+void MotionModel::prediction_step(const ekf_scalar delta_t, const ekf_scalar std_a, const ekf_scalar std_alpha, Eigen::Matrix<ekf_scalar, 13, 1> & xv, Eigen::Matrix<ekf_scalar, 13, 13> & F, Eigen::Matrix<ekf_scalar, 13, 13> & Q){
 
 	/****************************************
 	 * Camera motion prediction
 	 ****************************************/
-	Eigen::Vector3d rW_old = x_k_k.segment(0,3); //Extract (last step) position from state vector
-	Eigen::Vector4d qWR_old = x_k_k.segment(3,4); //Extract (last step) orientation quaterion from state vector
-	Eigen::Vector3d vW_old = x_k_k.segment(7, 3);  //Extract (last step) velocity from state vector
-	Eigen::Vector3d wW_old = x_k_k.segment(10, 3); //Extract (last step) angular velocity from state vector
-
-	Eigen::Vector4d qWT;
-	MotionModel::quaternion_from_angular_velocity(wW_old * delta_t, qWT);
+	Vector3s rW_old = xv.segment<3>(0); //Extract (last step) position from camera state vector
+	Vector4s qWR_old = xv.segment<4>(3); //Extract (last step) orientation quaterion from camera state vector
+	Vector3s vW_old = xv.segment<3>(7);  //Extract (last step) velocity from camera state vector
+	Vector3s wW_old = xv.segment<3>(10); //Extract (last step) angular velocity from camera state vector
+
+	//Rotation during delta_t. Its sine and cosine are shared by qWT and by its derivative against the angular velocity:
+	const ekf_scalar omega = wW_old.norm();
+	const ekf_scalar sin_half_angle = sin(omega * delta_t / 2.0);
+	const ekf_scalar cos_half_angle = cos(omega * delta_t / 2.0);
+
+	Vector4s qWT;
+	if (omega > 0) {
+		qWT << cos_half_angle, (sin_half_angle / omega) * wW_old;
+	} else {
+		qWT << 1, 0, 0, 0;
+	}
 
-	Eigen::Vector4d qWR_new;
+	Vector4s qWR_new;
 	qprod(qWR_old,  qWT, qWR_new);
 
+	///////// dqnew_by_domega, used by both F and Q /////////
+	// dqnew_by_domega = d(q x qwt)_by_dqwt . dqwt_by_domega
+	Matrix4s dqXqwt_by_dqwt;
+	MotionModel::dq3_by_dq1(qWR_old, dqXqwt_by_dqwt);
+
+	Eigen::Matrix<ekf_scalar, 4, 3> dqwt_by_domega;
+	MotionModel::dqomegadt_by_domega(wW_old, delta_t, sin_half_angle, cos_half_angle, dqwt_by_domega);
+
+	Eigen::Matrix<ekf_scalar, 4, 3> dqnew_by_domega = dqXqwt_by_dqwt * dqwt_by_domega;
+
 	///////// compute F /////////
-	MotionModel::compute_F(delta_t, qWR_old, wW_old, qWT, F);
+	MotionModel::compute_F(delta_t, qWT, dqnew_by_domega, F);
 
 	///////// compute Q /////////
-	MotionModel::compute_Q(delta_t, qWR_old, wW_old, std_a, std_alpha, Q);
+	MotionModel::compute_Q(delta_t, std_a, std_alpha, dqnew_by_domega, Q);
 
 	//Update XV:
 	//Motion model (constant speed), estimated position is the current position plus the velocity * delta_time:
 	//New position:
-	x_k_k.segment(0, 3) = rW_old + vW_old*delta_t;
+	xv.segment<3>(0) = rW_old + vW_old*delta_t;
 
 	//New orientation
-	x_k_k.segment(3, 4) = qWR_new;
+	xv.segment<4>(3) = qWR_new;
 
 	//Linear and angular velocities are updated by the kalman filter update step
 }
 
-void MotionModel::compute_F(const double delta_t, const Eigen::Vector4d & qWR_old, const Eigen::Vector3d & wW_old, const Eigen::Vector4d & qWT, Eigen::MatrixXd & F){
+void MotionModel::compute_F(const ekf_scalar delta_t, const Vector4s & qWT, const Eigen::Matrix<ekf_scalar, 4, 3> & dqnew_by_domega, Eigen::Matrix<ekf_scalar, 13, 13> & F){
 	// Now on to the Jacobian...
 	// Identity is a good place to start since overall structure is like this
 	// I       0             dxnew_by_dv   0
@@ -42,83 +61,59 @@ void MotionModel::compute_F(const double delta_t, const Eigen::Vector4d & qWR_ol
 	// 0       0             0             I
 
 	//Start with an identity matrix
-	F.setIdentity(13, 13);
-
-	// dxnew_by_dv = I * delta_t
-	Eigen::Matrix3d dxnew_by_dv = Eigen::Matrix3d::Identity() * delta_t;
+	F.setIdentity();
 
 	// Fill in dqnew_by_dq
-	Eigen::Matrix4d dqnew_by_dq;
+	Matrix4s dqnew_by_dq;
 	MotionModel::dq3_by_dq2(qWT, dqnew_by_dq);
 
-	// Fill in dqnew_by_domega = d(q x qwt)_by_dqwt . dqwt_by_domega
-	Eigen::Matrix4d dqXqwt_by_dqwt;
-	MotionModel::dq3_by_dq1(qWR_old, dqXqwt_by_dqwt);
-
-	// Use function below for dqwt_by_domega
-	Eigen::MatrixXd dqwt_by_domega(4,3);
-	MotionModel::dqomegadt_by_domega(wW_old, delta_t, dqwt_by_domega);
-
 	// And plug it in
-	F.block<3, 3>(0, 7) = dxnew_by_dv;
+	F.block<3, 3>(0, 7).diagonal().setConstant(delta_t); // dxnew_by_dv = I * delta_t
 	F.block<4, 4>(3, 3) = dqnew_by_dq;
-	F.block<4, 3>(3, 10) = dqXqwt_by_dqwt * dqwt_by_domega;
+	F.block<4, 3>(3, 10) = dqnew_by_domega;
 }
 
-void MotionModel::compute_Q(const double delta_t, const Eigen::Vector4d & qWR_old, const Eigen::VectorXd & wW_old, const double std_a, const double std_alpha, Eigen::MatrixXd & Q){
-	// Fill noise covariance matrix Pnn: this is the covariance of
+void MotionModel::compute_Q(const ekf_scalar delta_t, const ekf_scalar std_a, const ekf_scalar std_alpha, const Eigen::Matrix<ekf_scalar, 4, 3> & dqnew_by_domega, Eigen::Matrix<ekf_scalar, 13, 13> & Q){
+	// Noise covariance matrix Pnn: this is the covariance of
 	// the noise vector (V)
 	//                  (Omega)
 	// that gets added to the state.
 	// Form of this could change later, but for now assume that
 	// V and Omega are independent, and that each of their components is
 	// independent...
-	double linear_velocity_noise_variance = std_a * std_a *
+	ekf_scalar linear_velocity_noise_variance = std_a * std_a *
 			delta_t * delta_t;
-	double angular_velocity_noise_variance = std_alpha * std_alpha *
+	ekf_scalar angular_velocity_noise_variance = std_alpha * std_alpha *
 			delta_t * delta_t;
 
-	// Independence means that the matrix is diagonal
-	Eigen::MatrixXd Pnn(6,6);
-	Pnn.setZero();
-	Pnn(0,0) = linear_velocity_noise_variance;
-	Pnn(1,1) = linear_velocity_noise_variance;
-	Pnn(2,2) = linear_velocity_noise_variance;
-	Pnn(3,3) = angular_velocity_noise_variance;
-	Pnn(4,4) = angular_velocity_noise_variance;
-	Pnn(5,5) = angular_velocity_noise_variance;
-
-	// Form Jacobian dxnew_by_dn
+	// Jacobian dxnew_by_dn
 	// Is like this:
 	// I * delta_t     0
 	// 0               dqnew_by_dOmega
 	// I               0
 	// 0               I
 
-	// Start by zeroing
-	Eigen::MatrixXd dxnew_by_dn(13,6);
-	dxnew_by_dn.setZero();
-
-	Eigen::Matrix4d dqXqwt_by_dqwt;
-	MotionModel::dq3_by_dq1(qWR_old, dqXqwt_by_dqwt);
-
-	Eigen::MatrixXd dqwt_by_domega(4,3);
-	MotionModel::dqomegadt_by_domega(wW_old, delta_t, dqwt_by_domega);
+	// Q = dxnew_by_dn . Pnn . dxnew_by_dnT. Pnn is diagonal, so Q is filled in block by block:
+	Q.setZero();
 
-	dxnew_by_dn.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity() * delta_t;
-	dxnew_by_dn.block<3, 3>(7, 0) = Eigen::Matrix3d::Identity();
-	dxnew_by_dn.block<3, 3>(10, 3) = Eigen::Matrix3d::Identity();
-	dxnew_by_dn.block<4, 3>(3, 3) = dqXqwt_by_dqwt*dqwt_by_domega;
+	// Position and linear velocity:
+	Q.block<3, 3>(0, 0).diagonal().setConstant(linear_velocity_noise_variance * delta_t * delta_t);
+	Q.block<3, 3>(0, 7).diagonal().setConstant(linear_velocity_noise_variance * delta_t);
+	Q.block<3, 3>(7, 0).diagonal().setConstant(linear_velocity_noise_variance * delta_t);
+	Q.block<3, 3>(7, 7).diagonal().setConstant(linear_velocity_noise_variance);
 
-	// Finally do Q = dxnew_by_dn . Pnn . dxnew_by_dnT
-	Q = dxnew_by_dn * Pnn * dxnew_by_dn.transpose();
+	// Orientation and angular velocity:
+	Q.block<4, 4>(3, 3) = angular_velocity_noise_variance * dqnew_by_domega * dqnew_by_domega.transpose();
+	Q.block<4, 3>(3, 10) = angular_velocity_noise_variance * dqnew_by_domega;
+	Q.block<3, 4>(10, 3) = angular_velocity_noise_variance * dqnew_by_domega.transpose();
+	Q.block<3, 3>(10, 10).diagonal().setConstant(angular_velocity_noise_variance);
 }
 
-void MotionModel::quaternion_from_angular_velocity(const Eigen::Vector3d & av, Eigen::Vector4d & q) {
-	double angle=av.norm();
+void MotionModel::quaternion_from_angular_velocity(const Vector3s & av, Vector4s & q) {
+	ekf_scalar angle=av.norm();
 	if (angle > 0) {
-	    const double c = cos(angle/2.0);
-	    const double s = sin(angle/2.0) / angle;
+	    const ekf_scalar c = cos(angle/2.0);
+	    const ekf_scalar s = sin(angle/2.0) / angle;
 
 	    q(0) = c;
 	    q(1) = s * av(0);
@@ -133,11 +128,11 @@ void MotionModel::quaternion_from_angular_velocity(const Eigen::Vector3d & av, E
 /*
  * JACOBIAN related functions:
  */
-void MotionModel::dq3_by_dq2(const Eigen::Vector4d & q2, Eigen::Matrix4d & m) {
-	double  w = q2(0);
-	double  x = q2(1);
-	double  y = q2(2);
-	double  z = q2(3);
+void MotionModel::dq3_by_dq2(const Vector4s & q2, Matrix4s & m) {
+	ekf_scalar  w = q2(0);
+	ekf_scalar  x = q2(1);
+	ekf_scalar  y = q2(2);
+	ekf_scalar  z = q2(3);
 
 	m << w, -x, -y, -z,
 			x,  w,  z, -y,
@@ -145,11 +140,11 @@ void MotionModel::dq3_by_dq2(const Eigen::Vector4d & q2, Eigen::Matrix4d & m) {
 			z,  y, -x,  w;
 }
 
-void MotionModel::dq3_by_dq1(const Eigen::Vector4d & q1, Eigen::Matrix4d & m) {
-	double  w = q1(0);
-	double  x = q1(1);
-	double  y = q1(2);
-	double  z = q1(3);
+void MotionModel::dq3_by_dq1(const Vector4s & q1, Matrix4s & m) {
+	ekf_scalar  w = q1(0);
+	ekf_scalar  x = q1(1);
+	ekf_scalar  y = q1(2);
+	ekf_scalar  z = q1(3);
 
 	m << w, -x, -y, -z,
 			x,  w, -z,  y,
@@ -158,26 +153,29 @@ void MotionModel::dq3_by_dq1(const Eigen::Vector4d & q1, Eigen::Matrix4d & m) {
 
 }
 
-void MotionModel::dqomegadt_by_domega(const Eigen::Vector3d &omega,
-		const double delta_t,
-		Eigen::MatrixXd & dqomegadt_by_domega) {
+void MotionModel::dqomegadt_by_domega(const Vector3s &omega,
+		const ekf_scalar delta_t,
+		const ekf_scalar sin_half_angle,
+		const ekf_scalar cos_half_angle,
+		Eigen::Matrix<ekf_scalar, 4, 3> & dqomegadt_by_domega) {
 	// Modulus
-	double omegamod = sqrt(omega(0) * omega(0) + omega(1) * omega(1) +
+	ekf_scalar omegamod = sqrt(omega(0) * omega(0) + omega(1) * omega(1) +
 			omega(2) * omega(2));
 
 	// Use generic ancillary functions to calculate components of Jacobian
-	dqomegadt_by_domega(0, 0) = dq0_by_domegaA(omega(0), omegamod, delta_t);
-	dqomegadt_by_domega(0, 1) = dq0_by_domegaA(omega(1), omegamod, delta_t);
-	dqomegadt_by_domega(0, 2) = dq0_by_domegaA(omega(2), omegamod, delta_t);
-	dqomegadt_by_domega(1, 0) = dqA_by_domegaA(omega(0), omegamod, delta_t);
-	dqomegadt_by_domega(1, 1) = dqA_by_domegaB(omega(0), omega(1), omegamod, delta_t);
-	dqomegadt_by_domega(1, 2) = dqA_by_domegaB(omega(0), omega(2), omegamod, delta_t);
-	dqomegadt_by_domega(2, 0) = dqA_by_domegaB(omega(1), omega(0), omegamod, delta_t);
-	dqomegadt_by_domega(2, 1) = dqA_by_domegaA(omega(1), omegamod, delta_t);
-	dqomegadt_by_domega(2, 2) = dqA_by_domegaB(omega(1), omega(2), omegamod, delta_t);
-	dqomegadt_by_domega(3, 0) = dqA_by_domegaB(omega(2), omega(0), omegamod, delta_t);
-	dqomegadt_by_domega(3, 1) = dqA_by_domegaB(omega(2), omega(1), omegamod, delta_t);
-	dqomegadt_by_domega(3, 2) = dqA_by_domegaA(omega(2), omegamod, delta_t);
+	// (sin_half_angle and cos_half_angle are sin and cos of omegamod * delta_t / 2)
+	dqomegadt_by_domega(0, 0) = dq0_by_domegaA(omega(0), omegamod, delta_t, sin_half_angle);
+	dqomegadt_by_domega(0, 1) = dq0_by_domegaA(omega(1), omegamod, delta_t, sin_half_angle);
+	dqomegadt_by_domega(0, 2) = dq0_by_domegaA(omega(2), omegamod, delta_t, sin_half_angle);
+	dqomegadt_by_domega(1, 0) = dqA_by_domegaA(omega(0), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(1, 1) = dqA_by_domegaB(omega(0), omega(1), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(1, 2) = dqA_by_domegaB(omega(0), omega(2), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(2, 0) = dqA_by_domegaB(omega(1), omega(0), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(2, 1) = dqA_by_domegaA(omega(1), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(2, 2) = dqA_by_domegaB(omega(1), omega(2), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(3, 0) = dqA_by_domegaB(omega(2), omega(0), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(3, 1) = dqA_by_domegaB(omega(2), omega(1), omegamod, delta_t, sin_half_angle, cos_half_angle);
+	dqomegadt_by_domega(3, 2) = dqA_by_domegaA(omega(2), omegamod, delta_t, sin_half_angle, cos_half_angle);
 }
 
 //
@@ -185,9 +183,9 @@ void MotionModel::dqomegadt_by_domega(const Eigen::Vector3d &omega,
 // Ancillary function to calculate part of Jacobian \f$ \partial q / \partial
 // \omega \f$ which is repeatable due to symmetry. Here omegaA is one of omegax,
 // omegay, omegaz.
-double MotionModel::dq0_by_domegaA(const double omegaA, const double omega,
-		const double delta_t) {
-	return (-delta_t / 2.0) * (omegaA / omega) * sin(omega * delta_t / 2.0);
+ekf_scalar MotionModel::dq0_by_domegaA(const ekf_scalar omegaA, const ekf_scalar omega,
+		const ekf_scalar delta_t, const ekf_scalar sin_half_angle) {
+	return (-delta_t / 2.0) * (omegaA / omega) * sin_half_angle;
 }
 
 //
@@ -195,12 +193,12 @@ double MotionModel::dq0_by_domegaA(const double omegaA, const double omega,
 // Ancillary function to calculate part of Jacobian \f$ \partial q / \partial
 // \omega \f$ which is repeatable due to symmetry. Here omegaA is one of omegax,
 // omegay, omegaz and similarly with qA.
-double MotionModel::dqA_by_domegaA(const double omegaA, const double omega,
-		const double delta_t) {
+ekf_scalar MotionModel::dqA_by_domegaA(const ekf_scalar omegaA, const ekf_scalar omega,
+		const ekf_scalar delta_t, const ekf_scalar sin_half_angle, const ekf_scalar cos_half_angle) {
 	return (delta_t / 2.0) * omegaA * omegaA / (omega * omega)
-			* cos(omega * delta_t / 2.0)
+			* cos_half_angle
 			+ (1.0 / omega) * (1.0 - omegaA * omegaA / (omega * omega))
-			* sin(omega * delta_t / 2.0);
+			* sin_half_angle;
 }
 
 //
@@ -208,20 +206,20 @@ double MotionModel::dqA_by_domegaA(const double omegaA, const double omega,
 // Ancillary function to calculate part of Jacobian \f$ \partial q / \partial
 // \omega \f$ which is repeatable due to symmetry. Here omegaB is one of omegax,
 // omegay, omegaz and similarly with qA.
-double MotionModel::dqA_by_domegaB(const double omegaA, const double omegaB,
-		const double omega, double delta_t) {
+ekf_scalar MotionModel::dqA_by_domegaB(const ekf_scalar omegaA, const ekf_scalar omegaB,
+		const ekf_scalar omega, ekf_scalar delta_t, const ekf_scalar sin_half_angle, const ekf_scalar cos_half_angle) {
 	return (omegaA * omegaB / (omega * omega)) *
-			( (delta_t / 2.0) * cos(omega * delta_t / 2.0)
-					- (1.0 / omega) * sin(omega * delta_t / 2.0) );
+			( (delta_t / 2.0) * cos_half_angle
+					- (1.0 / omega) * sin_half_angle );
 }
 
 /*
  * Compute the derivative of a 3d position against a quaterion:
  */
-void MotionModel::dposw_dq(const Eigen::Vector3d & xyz, const Eigen::Vector4d & q, Eigen::Matrix<double, 3, 4> & dposw_dq){
+void MotionModel::dposw_dq(const Vector3s & xyz, const Vector4s & q, Eigen::Matrix<ekf_scalar, 3, 4> & dposw_dq){
 	dposw_dq.setZero();
 
-	Eigen::Matrix3d t33;
+	Matrix3s t33;
 	MotionModel::dR_by_dqw(q(0), q(1), q(2), q(3), t33);
 	dposw_dq.block<3, 1>(0, 0) = t33 * xyz;
 	MotionModel::dR_by_dqx(q(0), q(1), q(2), q(3), t33);
@@ -237,11 +235,11 @@ void MotionModel::dposw_dq(const Eigen::Vector3d & xyz, const Eigen::Vector4d &
  * From a quaternion to its orthogonal rotation matrix. Note that inv(q_rotation_matrix) = q_rotation_matrix' !! (cheap inverse)
  *
  */
-void MotionModel::quaternion_matrix(const Eigen::Vector4d & q, Eigen::Matrix3d & q_rotation_matrix){
-	double w=q(0);
-	double x=q(1);
-	double y=q(2);
-	double z=q(3);
+void MotionModel::quaternion_matrix(const Vector4s & q, Matrix3s & q_rotation_matrix){
+	ekf_scalar w=q(0);
+	ekf_scalar x=q(1);
+	ekf_scalar y=q(2);
+	ekf_scalar z=q(3);
 
 	q_rotation_matrix << w*w+x*x-y*y-z*z,    2*(x*y -w*z),     2*(z*x+w*y),
 					     2*(x*y+w*z)    , w*w-x*x+y*y-z*z,     2*(y*z-w*x),
@@ -6,73 +6,76 @@
 #include <math.h> //math
 
 #include "print.hpp" //print_txt
+#include "scalar.hpp" //ekf_scalar
 
 class MotionModel {
 private:
-	static void dR_by_dqw(const double w, const double x, const double y, const double z, Eigen::Matrix3d & m){
+	static void dR_by_dqw(const ekf_scalar w, const ekf_scalar x, const ekf_scalar y, const ekf_scalar z, Matrix3s & m){
 		m << 2*w, -2*z,  2*y,
 	 		 2*z,  2*w, -2*x,
 			-2*y,  2*x,  2*w;
 	}
 
 
-	static void dR_by_dqx(const double w, const double x, const double y, const double z, Eigen::Matrix3d & m){
+	static void dR_by_dqx(const ekf_scalar w, const ekf_scalar x, const ekf_scalar y, const ekf_scalar z, Matrix3s & m){
 		m << 2*x,  2*y,   2*z,
 			 2*y, -2*x,  -2*w,
 			 2*z,  2*w,  -2*x;
 	}
 
 
-	static void dR_by_dqy(const double w, const double x, const double y, const double z, Eigen::Matrix3d & m){
+	static void dR_by_dqy(const ekf_scalar w, const ekf_scalar x, const ekf_scalar y, const ekf_scalar z, Matrix3s & m){
 		m << -2*y, 2*x,  2*w,
 			  2*x, 2*y,  2*z,
 			 -2*w, 2*z, -2*y;
 	}
 
-	static void dR_by_dqz(const double w, const double x, const double y, const double z, Eigen::Matrix3d & m){
+	static void dR_by_dqz(const ekf_scalar w, const ekf_scalar x, const ekf_scalar y, const ekf_scalar z, Matrix3s & m){
 		m << -2*z, -2*w, 2*x,
 			  2*w, -2*z, 2*y,
 			  2*x,  2*y, 2*z;
 	}
 
-	static void qprod(const Eigen::Vector4d & q, const Eigen::Vector4d & p, Eigen::Vector4d & prod_result){
-		double a=q(0);
-		Eigen::Vector3d v = q.segment(1, 3); //coefficients q
-		double x=p(0);
-		Eigen::Vector3d u = p.segment(1, 3); //coefficients p
+	static void qprod(const Vector4s & q, const Vector4s & p, Vector4s & prod_result){
+		ekf_scalar a=q(0);
+		Vector3s v = q.segment(1, 3); //coefficients q
+		ekf_scalar x=p(0);
+		Vector3s u = p.segment(1, 3); //coefficients p
 
 		prod_result << a*x-v.transpose()*u, (a*u+x*v) + v.cross(u);
 	}
 public:
-	static void update_xv_and_compute_F(const double delta_t, Eigen::VectorXd & x_k_k, Eigen::MatrixXd & F);
+	static void update_xv_and_compute_F(const ekf_scalar delta_t, VectorXs & x_k_k, MatrixXs & F);
 
-	static void prediction_step(const double delta_t, const double std_a, const double std_alpha, Eigen::VectorXd & x_k_k, Eigen::MatrixXd & F, Eigen::MatrixXd & Q);
+	static void prediction_step(const ekf_scalar delta_t, const ekf_scalar std_a, const ekf_scalar std_alpha, Eigen::Matrix<ekf_scalar, 13, 1> & xv, Eigen::Matrix<ekf_scalar, 13, 13> & F, Eigen::Matrix<ekf_scalar, 13, 13> & Q);
 
-	static void compute_F(const double delta_t, const Eigen::Vector4d & qWR_old, const Eigen::Vector3d & wW_old, const Eigen::Vector4d & qWT, Eigen::MatrixXd & F);
+	static void compute_F(const ekf_scalar delta_t, const Vector4s & qWT, const Eigen::Matrix<ekf_scalar, 4, 3> & dqnew_by_domega, Eigen::Matrix<ekf_scalar, 13, 13> & F);
 
-	static void compute_Q(const double delta_t, const Eigen::Vector4d & qWR_old, const Eigen::VectorXd & wW_old, const double std_a, const double std_alpha, Eigen::MatrixXd & Q);
+	static void compute_Q(const ekf_scalar delta_t, const ekf_scalar std_a, const ekf_scalar std_alpha, const Eigen::Matrix<ekf_scalar, 4, 3> & dqnew_by_domega, Eigen::Matrix<ekf_scalar, 13, 13> & Q);
 
-	static void quaternion_matrix(const Eigen::Vector4d & q, Eigen::Matrix3d & q_rotation_matrix);
-	static void quaternion_from_angular_velocity(const Eigen::Vector3d & av, Eigen::Vector4d & q);
+	static void quaternion_matrix(const Vector4s & q, Matrix3s & q_rotation_matrix);
+	static void quaternion_from_angular_velocity(const Vector3s & av, Vector4s & q);
 
-	static void dq3_by_dq2(const Eigen::Vector4d & q2, Eigen::Matrix4d & m);
-	static void dq3_by_dq1(const Eigen::Vector4d & q1, Eigen::Matrix4d & m);
+	static void dq3_by_dq2(const Vector4s & q2, Matrix4s & m);
+	static void dq3_by_dq1(const Vector4s & q1, Matrix4s & m);
 
-	static void dqomegadt_by_domega(const Eigen::Vector3d &omega,
-			const double delta_t,
-			Eigen::MatrixXd &dqomegadt_by_domega);
+	static void dqomegadt_by_domega(const Vector3s &omega,
+			const ekf_scalar delta_t,
+			const ekf_scalar sin_half_angle,
+			const ekf_scalar cos_half_angle,
+			Eigen::Matrix<ekf_scalar, 4, 3> &dqomegadt_by_domega);
 
-	static double dq0_by_domegaA(const double omegaA, const double omega,
-			const double delta_t);
+	static ekf_scalar dq0_by_domegaA(const ekf_scalar omegaA, const ekf_scalar omega,
+			const ekf_scalar delta_t, const ekf_scalar sin_half_angle);
 
-	static double dqA_by_domegaA(const double omegaA, const double omega,
-			const double delta_t);
+	static ekf_scalar dqA_by_domegaA(const ekf_scalar omegaA, const ekf_scalar omega,
+			const ekf_scalar delta_t, const ekf_scalar sin_half_angle, const ekf_scalar cos_half_angle);
 
-	static double dqA_by_domegaB(const double omegaA, const double omegaB,
-			const double omega, double delta_t);
+	static ekf_scalar dqA_by_domegaB(const ekf_scalar omegaA, const ekf_scalar omegaB,
+			const ekf_scalar omega, ekf_scalar delta_t, const ekf_scalar sin_half_angle, const ekf_scalar cos_half_angle);
 
-	static void dposw_dq(const Eigen::Vector3d & xyz, const Eigen::Vector4d & q, Eigen::Matrix<double, 3, 4> & dposw_dq);
-	static void qconj(const Eigen::Vector4d & q, Eigen::Vector4d & qconj){
+	static void dposw_dq(const Vector3s & xyz, const Vector4s & q, Eigen::Matrix<ekf_scalar, 3, 4> & dposw_dq);
+	static void qconj(const Vector4s & q, Vector4s & qconj){
 		qconj(0) =  q(0); //w
 		qconj(1) = -q(1); //x
 		qconj(2) = -q(2); //y
@@ -9,6 +9,7 @@
 #include <opencv2/calib3d/calib3d.hpp> //findFundamentalMat
 #include <opencv2/imgproc/imgproc.hpp> //cvtColor
 #include <opencv2/video/tracking.hpp> //calcOpticalFlowPyrLK
+#include <opencv2/features2d/features2d.hpp> //FAST
 
 #include <Eigen/Dense> //Matrix
 
@@ -21,7 +22,12 @@ class MotionTracker {
 public:
 	virtual std::string type() = 0;
 
-	virtual void process(cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added) = 0;
+	virtual void process(const cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added) = 0;
+
+#ifndef EKFOA_HEADLESS
+	//Debug overlay of the last processed frame, process does not draw on it:
+	virtual void draw(cv::Mat & frame) const = 0;
+#endif
 
 	virtual ~MotionTracker(){}
 };
@@ -1,10 +1,20 @@
 #include "motion_tracker_of.hpp"
 
+#include <algorithm> //sort
+
+//From the cheapest, the last ones are the settings used without prediction:
+const MotionTrackerOF::SearchSettings MotionTrackerOF::search_settings_[MotionTrackerOF::NUM_SEARCH_SETTINGS] = {
+	{ 9, 0,  4},
+	{13, 1, 12},
+	{15, 2, 28},
+	{21, 3, 80}
+};
+
 std::string MotionTrackerOF::type(){
 	return std::string("OF");
 }
 
-void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added){
+void MotionTrackerOF::process(const cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added){
 	// '1' refers to previous frame
 	// '2' refers to last received (input parameter) frame
 
@@ -12,9 +22,11 @@ void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & f
 
 	std::vector<cv::Point2f> features_tracked;
 
-	if ( ! input_1_gray_.data ){
-		//At first frame, initialize the points_currently_tracked_mask_ Mat:
-		points_correctly_tracked_mask_ = cv::Mat(input_2.size(), CV_8UC1);
+	if ( pyramid_1_.empty() ){
+		//At first frame, initialize the occupancy grid:
+		grid_cell_size_ = 2*distance_between_points_;
+		grid_cols_ = (input_2.cols + grid_cell_size_ - 1)/grid_cell_size_;
+		grid_rows_ = (input_2.rows + grid_cell_size_ - 1)/grid_cell_size_;
 
 		//Set the dimensions of the input image. So that later we can easily check if the tracked point is inside it:
 		image_dimensions_.x = 0;
@@ -23,56 +35,78 @@ void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & f
 		image_dimensions_.width = input_2.cols;
 	}
 
-	points_correctly_tracked_mask_.setTo(cv::Scalar(255));
+	occupied_cells_.assign(grid_cols_*grid_rows_, 0);
+	p1_.clear();
+	p2_.clear();
+	status_ransac_.clear();
+	num_features_added_ = 0;
 
 //	double time = 0;
 
-	cv::Mat input_2_gray;
-	//Create a copy of the input in grayscale:
-	cv::cvtColor(input_2, input_2_gray, CV_RGB2GRAY);
+	//Only the intensity is tracked. Single channel frames (grayscale, or the Y plane of YUV frames) are used as they are, color ones
+	//are converted. The pyramid still copies the first level (with the border LK needs), so it never refers to the input frame:
+	if (input_2.channels() == 1){
+		input_2_gray_ = input_2;
+	} else {
+		cv::cvtColor(input_2, gray_buffer_, CV_RGB2GRAY);
+		input_2_gray_ = gray_buffer_;
+	}
+
+	//Its pyramid, large enough for every search settings:
+	const SearchSettings & largest_search = search_settings_[NUM_SEARCH_SETTINGS-1];
+	cv::buildOpticalFlowPyramid(
+			input_2_gray_,        // InputArray img
+			pyramid_2_,           // OutputArrayOfArrays pyramid
+			cv::Size(largest_search.window_size, largest_search.window_size), // Size winSize
+			largest_search.max_pyramid_level, // int maxLevel
+			true,                 // bool withDerivatives=true
+			cv::BORDER_REFLECT_101, // int pyrBorder=BORDER_REFLECT_101
+			cv::BORDER_CONSTANT,  // int derivBorder=BORDER_CONSTANT
+			false                 // bool tryReuseInputImage=true. The frame may be a camera buffer, that is reused before the next call
+	);
 
 	//If there are any features to track:
 	if (points_tracked_1.size() > 15) {
 //		time = (double)cv::getTickCount();
 
-		//Copy the predicted feature location to the OF points_tracked_2, it will try to find the feature appearance around the copied point.
-//		points_tracked_2.resize(features_extra.size());
-//		for (size_t i=0 ; i<features_extra.size() ; i++){
-//			points_tracked_2[i].x = features_extra[i].h(0);
-//			points_tracked_2[i].y = features_extra[i].h(1);
-//		}
-
-		//TODO: Use 'OPTFLOW_USE_INITIAL_FLOW' with the kalman filter prediction. So that the estimations are considered the initial estimate
-		// Find position of feature in new image
-		cv::calcOpticalFlowPyrLK(
-				input_1_gray_, input_2_gray, // 2 consecutive images
-				points_tracked_1,            // input: interesting features points
-				points_tracked_2,            // output: the respective positions (in second frame) of the input points
-				status_of_,                  // output status vector (of unsigned chars)
-				err,                          // output vector of errors
-				cv::Size(21,21),
-				3//,
-//				cv::TermCriteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01),
-//				cv::OPTFLOW_USE_INITIAL_FLOW
-		);
-		//Use the same images in reverse order to verify that the points we got in the previous OpticFlow were correct
-		cv::calcOpticalFlowPyrLK(
-				input_2_gray, input_1_gray_,  // 2 consecutive images reversed
-				points_tracked_2,             // input: interesting features points
-				points_tracked_1_reverse,     // output: the respective positions (in second frame) of the input points
-				status_of_reverse_,           // tracking success
-				err,                           // tracking error
-				cv::Size(21,21),
-				3,
-				cv::TermCriteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01),
-				0
-		);
+		const size_t num_points = points_tracked_1.size();
+		points_tracked_2 = points_tracked_1;
+		points_tracked_1_reverse = points_tracked_1;
+		status_of_.assign(num_points, 0);
+		status_of_reverse_.assign(num_points, 0);
+
+		//Group the features by the search settings their prediction needs. The ones predicted outside the image (or behind the
+		//camera) are not tracked, their status stays 0:
+		std::vector<size_t> features_to_track[NUM_SEARCH_SETTINGS];
+		for (size_t i=0 ; i<num_points ; i++){
+			const cv::Point2f predicted(features_extra[i].h(0), features_extra[i].h(1));
+			if (!features_extra[i].is_valid || !predicted.inside(image_dimensions_))
+				continue;
+
+			//3 sigma along the major axis of the innovation covariance:
+			const Matrix2s & S = features_extra[i].S;
+			const ekf_scalar half_trace = (S(0, 0) + S(1, 1))/2;
+			const ekf_scalar half_difference = (S(0, 0) - S(1, 1))/2;
+			const float search_radius = 3*std::sqrt(half_trace + std::sqrt(half_difference*half_difference + S(0, 1)*S(0, 1)));
+
+			int settings = 0;
+			while (settings < NUM_SEARCH_SETTINGS-1 && search_settings_[settings].max_prediction_error < search_radius){
+				settings++;
+			}
+			features_to_track[settings].push_back(i);
+		}
+
+		for (int settings=0 ; settings<NUM_SEARCH_SETTINGS ; settings++){
+			if (!features_to_track[settings].empty()){
+				track_features(features_extra, features_to_track[settings], search_settings_[settings]);
+			}
+		}
 //		time = (double)cv::getTickCount() - time;
 //		std::cout << "time OF = " << time/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
 
-		std::vector<cv::Point2f> p1;
-		std::vector<cv::Point2f> p2;
-		std::vector<uchar> status_ransac;
+		std::vector<cv::Point2f> & p1 = p1_;
+		std::vector<cv::Point2f> & p2 = p2_;
+		std::vector<uchar> & status_ransac = status_ransac_;
 		std::vector<size_t> removed_of;
 		for(size_t i=0; i < points_tracked_1.size() ; i++) {
 			//TODO: features_extra[i].is_valid can be checked before, for optimization, but then synchronization needs to be handled.
@@ -88,12 +122,8 @@ void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & f
 
 		cv::findFundamentalMat(p1, p2, cv::FM_RANSAC, 0.5, 0.99, status_ransac);
 
-		cv::Scalar color;
-
 		size_t counter_removed_of=0;//counter_removed_of is keeps track of the number of features smaller than the current feature
 		for(size_t i=0; i < p1.size() ; i++) {
-			color = cv::Scalar(0, 0, 255, 255);//red
-
 			//Count if there were any features removed by OF, it will be an offset
 			while(counter_removed_of<removed_of.size() && i+counter_removed_of >= removed_of[counter_removed_of]){
 				counter_removed_of++;
@@ -108,29 +138,11 @@ void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & f
 				features_tracked.push_back(p2[i]);
 
 				//make sure new features are not above or too close to this feature:
-				cv::circle(points_correctly_tracked_mask_, p2[i], distance_between_points_, cv::Scalar(0), CV_FILLED);
-
-				//color it in  the frame as green:
-				color = cv::Scalar(0, 255, 0, 255);//green
-				//Write the feature index next to it:
-				std::stringstream text;
-				text << features_tracked.size()-1;
-				cv::Point2f text_start(p2[i].x+5, p2[i].y+5);
-				cv::putText(input_2, text.str(), text_start, cv::FONT_HERSHEY_SIMPLEX, 0.5, color);
-
+				mark_occupied_cells(p2[i]);
 			} else {
 				//Feature disappeared from image or was not correctly tracked, so mark it for deletion:
 				features_extra[i+counter_removed_of].is_valid = false;
 			}
-
-			//Draw circle at current position:
-			cv::circle(input_2, p2[i], 3, color, 1);
-
-			//Draw line between start position and end position:
-			cv::line(input_2,
-					p1[i],   // initial position
-					p2[i],   // new position
-					cv::Scalar(255, 255, 0));
 		}
 
 		//Finally, remember the correctly tracked points (for next call):
@@ -140,37 +152,269 @@ void MotionTrackerOF::process(cv::Mat & input_2, std::vector<Features_extra> & f
 	int num_new_features = min_number_of_features_in_image_ - features_tracked.size();
 
 	if (num_new_features > 0){
-		//TODO: Try to use some FAST heuristics to prefer unoccupied areas for new features...like a grid and one feature per square.
 //		time = (double)cv::getTickCount();
-		cv::goodFeaturesToTrack(
-				input_2_gray,      // InputArray image
-				features_added, // OutputArray corners
-				num_new_features,  // int maxCorners - Number of points to detect
-				0.01,              // double qualityLevel=0.01 (larger is better quality)
-				distance_between_points_, // double minDistance=1
-				points_correctly_tracked_mask_,    // InputArray mask=noArray(). Where it should not look for new features
-				3,              // int blockSize=3
-				true,             // bool useHarrisDetector=false
-				0.04              // double k=0.04
-		);
+		detect_features(num_new_features, features_added);
 		//Add new points to the currently tracked features at the beginning:
 		points_tracked_1.insert(points_tracked_1.end(), features_added.begin(), features_added.end());
+		num_features_added_ = features_added.size();
 
-		//Draw the newly added features in blue:
-		for (size_t i=0 ; i<features_added.size() ; i++){
-			cv::circle(input_2, features_added[i], 3, cv::Scalar(255,0,0), 1);
+//		time = (double)cv::getTickCount() - time;
+//		std::cout << "detect_features = " << time/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
+	}
+
+	//Remember the pyramid of this frame for next call, the buffers of the previous one are reused for the next frame:
+	pyramid_1_.swap(pyramid_2_);
+}
+
+/*
+ * keep_added_features:
+ * The features are tracked in the order of the filter state (features_extra), so the new ones the filter did not add
+ * (Kalman::add_features_inverse_depth) are dropped from the end of points_tracked_1.
+ */
+void MotionTrackerOF::keep_added_features(const size_t num_kept){
+	if (num_kept >= num_features_added_)
+		return;
+
+	points_tracked_1.resize(points_tracked_1.size() - (num_features_added_ - num_kept));
+	num_features_added_ = num_kept;
+}
+
+#ifndef EKFOA_HEADLESS
+/*
+ * draw:
+ * The tracked features (green, with their index), the ones rejected by RANSAC (red), their motion, and the new ones (blue).
+ */
+void MotionTrackerOF::draw(cv::Mat & frame) const{
+	size_t num_tracked = 0;
+	for (size_t i=0 ; i<p1_.size() ; i++){
+		cv::Scalar color = cv::Scalar(0, 0, 255, 255);//red
+
+		if (status_ransac_[i]){
+			color = cv::Scalar(0, 255, 0, 255);//green
+			//Write the feature index next to it:
 			std::stringstream text;
-			text << features_tracked.size() + i;
-			cv::Point2f text_start(features_added[i].x+5, features_added[i].y+5);
-			cv::putText(input_2, text.str(), text_start, cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255,0,0));
+			text << num_tracked++;
+			cv::Point2f text_start(p2_[i].x+5, p2_[i].y+5);
+			cv::putText(frame, text.str(), text_start, cv::FONT_HERSHEY_SIMPLEX, 0.5, color);
 		}
 
-//		time = (double)cv::getTickCount() - time;
-//		std::cout << "goodFeaturesToTrack = " << time/((double)cvGetTickFrequency()*1000.) << "ms" << std::endl;
+		//Draw circle at current position:
+		cv::circle(frame, p2_[i], 3, color, 1);
+
+		//Draw line between start position and end position:
+		cv::line(frame,
+				p1_[i],   // initial position
+				p2_[i],   // new position
+				cv::Scalar(255, 255, 0));
+	}
+
+	//The newly added features, in blue:
+	const size_t first_added = points_tracked_1.size() - num_features_added_;
+	for (size_t i=first_added ; i<points_tracked_1.size() ; i++){
+		cv::circle(frame, points_tracked_1[i], 3, cv::Scalar(255,0,0), 1);
+		std::stringstream text;
+		text << num_tracked + i - first_added;
+		cv::Point2f text_start(points_tracked_1[i].x+5, points_tracked_1[i].y+5);
+		cv::putText(frame, text.str(), text_start, cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255,0,0));
+	}
+}
+#endif
+
+/*
+ * mark_occupied_cells:
+ * Marks the cells of the occupancy grid closer than distance_between_points_ to a tracked feature (its bounding box).
+ */
+void MotionTrackerOF::mark_occupied_cells(const cv::Point2f & point){
+	const int col_min = std::max(0, (int)((point.x - distance_between_points_)/grid_cell_size_));
+	const int col_max = std::min(grid_cols_-1, (int)((point.x + distance_between_points_)/grid_cell_size_));
+	const int row_min = std::max(0, (int)((point.y - distance_between_points_)/grid_cell_size_));
+	const int row_max = std::min(grid_rows_-1, (int)((point.y + distance_between_points_)/grid_cell_size_));
+
+	for (int row=row_min ; row<=row_max ; row++){
+		for (int col=col_min ; col<=col_max ; col++){
+			occupied_cells_[row*grid_cols_ + col] = 1;
+		}
 	}
+}
 
-	//Remember this frame for next call:
-	input_1_gray_ = input_2_gray.clone();
+static bool stronger_corner(const cv::KeyPoint & a, const cv::KeyPoint & b){
+	return a.response > b.response;
+}
+
+/*
+ * detect_features:
+ * Bucketed detection: the strongest FAST corner of each free cell of the occupancy grid, in parallel (the cells are independent).
+ * The num_new_features strongest ones are added, at most one per cell, so they are spread over the image. Only the free cells are
+ * searched, so the cost grows with the free area instead of the image size.
+ */
+void MotionTrackerOF::detect_features(const int num_new_features, std::vector<cv::Point2f> & features_added){
+	std::vector<int> free_cells;
+	for (int cell=0 ; cell<grid_cols_*grid_rows_ ; cell++){
+		if (!occupied_cells_[cell]){
+			free_cells.push_back(cell);
+		}
+	}
+
+	std::vector<cv::KeyPoint> cell_corners(free_cells.size());
+	#pragma omp parallel for
+	for (int k=0 ; k<(int)free_cells.size() ; k++){
+		const int col = free_cells[k] % grid_cols_;
+		const int row = free_cells[k] / grid_cols_;
+		const cv::Rect cell(col*grid_cell_size_, row*grid_cell_size_,
+				std::min(grid_cell_size_, input_2_gray_.cols - col*grid_cell_size_),
+				std::min(grid_cell_size_, input_2_gray_.rows - row*grid_cell_size_));
+
+		//FAST needs a 3 pixel border around the candidates, so the cell is searched with it (inside the image):
+		const cv::Rect search = cv::Rect(cell.x - 3, cell.y - 3, cell.width + 6, cell.height + 6) & image_dimensions_;
+
+		std::vector<cv::KeyPoint> corners;
+		cv::FAST(
+				input_2_gray_(search), // InputArray image
+				corners,               // vector<KeyPoint> keypoints
+				20,                    // int threshold (intensity difference with the center)
+				true                   // bool nonmaxSuppression
+		);
+
+		cell_corners[k].response = -1; //no corner in this cell
+		for (size_t j=0 ; j<corners.size() ; j++){
+			corners[j].pt += cv::Point2f(search.x, search.y);
+			if (corners[j].response > cell_corners[k].response && cell.contains(corners[j].pt)){
+				cell_corners[k] = corners[j];
+			}
+		}
+	}
+
+	std::sort(cell_corners.begin(), cell_corners.end(), stronger_corner);
+
+	features_added.clear();
+	for (size_t k=0 ; k<cell_corners.size() && (int)features_added.size()<num_new_features && cell_corners[k].response>=0 ; k++){
+		features_added.push_back(cell_corners[k].pt);
+	}
+}
+
+/*
+ * track_features:
+ * Finds the features (indexes of points_tracked_1) in the current frame (pyramid_2_) with LK, starting at their predicted position
+ * (h), and back in the previous frame (pyramid_1_) to verify them, as chosen by the verification policy.
+ */
+void MotionTrackerOF::track_features(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & features, const SearchSettings & settings){
+	const size_t num_features = features.size();
+	std::vector<cv::Point2f> points_1(num_features);
+	std::vector<cv::Point2f> points_2(num_features);
+	std::vector<uchar> status(num_features);
+
+	for (size_t k=0 ; k<num_features ; k++){
+		points_1[k] = points_tracked_1[features[k]];
+		points_2[k] = cv::Point2f(features_extra[features[k]].h(0), features_extra[features[k]].h(1));
+	}
+
+	const cv::Size window(settings.window_size, settings.window_size);
+	const cv::TermCriteria criteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01);
+
+	// Find position of feature in new image
+	cv::calcOpticalFlowPyrLK(
+			pyramid_1_, pyramid_2_,      // 2 consecutive images
+			points_1,                    // input: interesting features points
+			points_2,                    // input: the predicted positions, output: the respective positions (in second frame) of the input points
+			status,                      // output status vector (of unsigned chars)
+			err,                         // output vector of errors
+			window,
+			settings.max_pyramid_level,
+			criteria,
+			cv::OPTFLOW_USE_INITIAL_FLOW
+	);
+
+	//Choose the features to track back (err is overwritten by the reverse search, so before it). The ones lost by LK are rejected anyway:
+	std::vector<size_t> features_to_verify;
+	std::vector<size_t> features_sampled;
+	std::vector<size_t> features_skipped;
+	int num_matched = 0;
+	for (size_t k=0 ; k<num_features ; k++){
+		const size_t i = features[k];
+		points_tracked_2[i] = points_2[k];
+		status_of_[i] = status[k];
+		if (!status[k])
+			continue;
+
+		if (verification_policy_ == VERIFY_ADAPTIVE){
+			const Vector2s innovation(points_2[k].x - features_extra[i].h(0), points_2[k].y - features_extra[i].h(1));
+			if (err[k] < max_lk_error_ && innovation.dot(features_extra[i].S.inverse()*innovation) < max_innovation_chi2_){
+				if (sample_period_ > 0 && num_matched++ % sample_period_ == 0){
+					features_sampled.push_back(i);
+				} else {
+					features_skipped.push_back(i);
+				}
+				continue;
+			}
+		}
+		features_to_verify.push_back(i);
+	}
+	features_to_verify.insert(features_to_verify.end(), features_sampled.begin(), features_sampled.end());
+
+	track_features_back(features_extra, features_to_verify, settings);
+
+	//If a sampled feature had a low LK error but was wrong, the LK error is not trusted for the rest of this search either:
+	bool samples_passed = true;
+	for (size_t k=0 ; k<features_sampled.size() && samples_passed ; k++){
+		samples_passed = accept_tracked_point(features_sampled[k]);
+	}
+
+	if (samples_passed){
+		for (size_t k=0 ; k<features_skipped.size() ; k++){
+			points_tracked_1_reverse[features_skipped[k]] = points_tracked_1[features_skipped[k]];
+			status_of_reverse_[features_skipped[k]] = 1;
+		}
+		verification_stats_.skipped += features_skipped.size();
+	} else {
+		track_features_back(features_extra, features_skipped, settings);
+		verification_stats_.verified += features_skipped.size();
+		verification_stats_.fallbacks++;
+	}
+	verification_stats_.verified += features_to_verify.size();
+}
+
+/*
+ * track_features_back:
+ * Tracks the features from their position in this frame back to the previous one, for the forward-backward error of
+ * accept_tracked_point. The reverse search starts at the previous position moved by the same correction the forward one made to
+ * the prediction, so it covers the same prediction error.
+ */
+void MotionTrackerOF::track_features_back(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & features, const SearchSettings & settings){
+	const size_t num_features = features.size();
+	if (num_features == 0)
+		return;
+
+	std::vector<cv::Point2f> points_2(num_features);
+	std::vector<cv::Point2f> points_1_reverse(num_features);
+	std::vector<uchar> status_reverse(num_features);
+
+	for (size_t k=0 ; k<num_features ; k++){
+		const size_t i = features[k];
+		const cv::Point2f predicted(features_extra[i].h(0), features_extra[i].h(1));
+		points_2[k] = points_tracked_2[i];
+		points_1_reverse[k] = points_tracked_1[i] + (points_2[k] - predicted);
+	}
+
+	const cv::Size window(settings.window_size, settings.window_size);
+	const cv::TermCriteria criteria(cv::TermCriteria::COUNT+cv::TermCriteria::EPS, 30, 0.01);
+
+	//Use the same images in reverse order to verify that the points we got in the previous OpticFlow were correct
+	cv::calcOpticalFlowPyrLK(
+			pyramid_2_, pyramid_1_,       // 2 consecutive images reversed
+			points_2,                     // input: interesting features points
+			points_1_reverse,             // output: the respective positions (in second frame) of the input points
+			status_reverse,               // tracking success
+			err,                          // tracking error
+			window,
+			settings.max_pyramid_level,
+			criteria,
+			cv::OPTFLOW_USE_INITIAL_FLOW
+	);
+
+	for (size_t k=0 ; k<num_features ; k++){
+		points_tracked_1_reverse[features[k]] = points_1_reverse[k];
+		status_of_reverse_[features[k]] = status_reverse[k];
+	}
 }
 
 // determine which tracked point should be accepted. Rejected by: reverse OF match, OF status (OF and reverseOF) or RANSAC)
@@ -5,13 +5,65 @@
 
 class MotionTrackerOF: public MotionTracker {
 public:
+	/*
+	 * Forward-backward verification (the reverse LK pass) of the tracked features:
+	 *  VERIFY_ALL: every feature is tracked back.
+	 *  VERIFY_ADAPTIVE: a feature is not tracked back if its forward LK error is under max_lk_error and its innovation (z - h) is
+	 *   inside the S gate (z - h)'*inv(S)*(z - h) < max_innovation_chi2, except 1 of each sample_period of them. If any of those
+	 *   samples fails, all the features of its search are tracked back. RANSAC still checks every feature.
+	 * The innovation gate alone would mostly confirm itself: LK starts at h with a window sized from S, so wherever it converges the
+	 * innovation is mostly consistent with S. The LK error is how different the patches of both frames are, wherever the search
+	 * started. A feature that converged on a similar looking patch inside the gate still passes both, the samples and RANSAC are
+	 * what catch those.
+	 */
+	enum VerificationPolicy { VERIFY_ALL, VERIFY_ADAPTIVE };
+
+	//How often each verification path was taken, in features (and searches for fallbacks):
+	struct VerificationStats {
+		size_t verified;  //tracked back: LK error over the gate, sampled, or fallback
+		size_t skipped;   //accepted on their LK error (and RANSAC) alone
+		size_t fallbacks; //searches whose samples failed, so all their features were tracked back
+	};
+
 	MotionTrackerOF(int min_number_of_features_in_image, int distance_between_points) :
 			min_number_of_features_in_image_(min_number_of_features_in_image),
-			distance_between_points_(distance_between_points) {}
+			distance_between_points_(distance_between_points),
+			num_features_added_(0),
+			verification_policy_(VERIFY_ALL),
+			max_lk_error_(0),
+			max_innovation_chi2_(0),
+			sample_period_(0) {
+		reset_verification_stats();
+	}
 
 	std::string type();
 
-	void process(cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added);
+	/*
+	 * max_lk_error: forward LK error (mean absolute intensity difference of the patches, as calcOpticalFlowPyrLK reports it)
+	 * below which a feature may not be tracked back.
+	 * max_innovation_chi2: squared Mahalanobis distance of the innovation below which it may not either (5.99 is the 95% gate of 2 dof).
+	 * sample_period: 1 of each sample_period of the features under both is still tracked back (0: none).
+	 */
+	void set_verification(VerificationPolicy policy, float max_lk_error, ekf_scalar max_innovation_chi2, int sample_period){
+		verification_policy_ = policy;
+		max_lk_error_ = max_lk_error;
+		max_innovation_chi2_ = max_innovation_chi2;
+		sample_period_ = sample_period;
+	}
+	const VerificationStats & verification_stats() const { return verification_stats_; }
+	void reset_verification_stats(){
+		verification_stats_.verified = 0;
+		verification_stats_.skipped = 0;
+		verification_stats_.fallbacks = 0;
+	}
+
+	void process(const cv::Mat & input_2, std::vector<Features_extra> & features_extra, std::vector<cv::Point2f> & features_added);
+	//Only the first num_kept features added by the last process call are tracked, for the ones the filter did not add (its feature limit):
+	void keep_added_features(const size_t num_kept);
+
+#ifndef EKFOA_HEADLESS
+	void draw(cv::Mat & frame) const;
+#endif
 
 	~MotionTrackerOF(){}
 private:
@@ -24,8 +76,19 @@ private:
 	// '1' refers to previous frame
 	// '2' refers to last received (input parameter) frame
 
-	cv::Mat input_1_gray_;
-	cv::Mat points_correctly_tracked_mask_; //Used to filter out currently used locations of the image, so that new features do not overlap with existing ones.
+	//Intensity of the current frame: the input itself if it has a single channel, otherwise converted into gray_buffer_:
+	cv::Mat input_2_gray_;
+	cv::Mat gray_buffer_;
+	//LK pyramids (with derivatives) of each frame, built once and shared by every forward and reverse search of this frame and the next one.
+	//Double buffers, swapped at the end of each call instead of copied:
+	std::vector<cv::Mat> pyramid_1_;
+	std::vector<cv::Mat> pyramid_2_;
+	//Occupancy grid for new features: one feature per cell (of 2*distance_between_points_ pixels), the cells closer than
+	//distance_between_points_ to a tracked feature are occupied, so that new features do not overlap with existing ones:
+	int grid_cell_size_;
+	int grid_cols_;
+	int grid_rows_;
+	std::vector<uchar> occupied_cells_;
 
 	std::vector<cv::Point2f> points_tracked_1;
 	std::vector<cv::Point2f> points_tracked_2;
@@ -35,6 +98,32 @@ private:
 	std::vector<uchar> status_of_reverse_; // status of tracked features (Optical Flow second)
 	std::vector<float> err;    // error of tracked features (Optical Flow)
 
+	//Features that passed the LK checks (previous and current position), and their RANSAC status. Kept for draw:
+	std::vector<cv::Point2f> p1_;
+	std::vector<cv::Point2f> p2_;
+	std::vector<uchar> status_ransac_;
+	size_t num_features_added_; //at the end of points_tracked_1
+
+	//Active search: LK starts at the position predicted by the filter, so its window and pyramid only have to cover the
+	//prediction error. Each feature is tracked with the cheapest settings that cover 3 sigma of its innovation covariance:
+	struct SearchSettings {
+		int window_size;
+		int max_pyramid_level;
+		float max_prediction_error; //pixels, that these settings recover from
+	};
+	enum { NUM_SEARCH_SETTINGS = 4 };
+	static const SearchSettings search_settings_[NUM_SEARCH_SETTINGS];
+
+	VerificationPolicy verification_policy_;
+	float max_lk_error_;
+	ekf_scalar max_innovation_chi2_;
+	int sample_period_;
+	VerificationStats verification_stats_;
+
+	void mark_occupied_cells(const cv::Point2f & point);
+	void detect_features(const int num_new_features, std::vector<cv::Point2f> & features_added);
+	void track_features(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & features, const SearchSettings & settings);
+	void track_features_back(const std::vector<Features_extra> & features_extra, const std::vector<size_t> & features, const SearchSettings & settings);
 	bool accept_tracked_point(size_t i);
 };
 
@@ -0,0 +1,101 @@
+#include "camera.hpp"
+#include "feature.hpp"
+#include "motion_model.hpp"
+
+#include <opencv2/core/core.hpp> //getTickCount
+
+#include <algorithm> //max
+#include <cstdlib> //rand
+#include <iostream> //cout
+#include <vector> //vector
+
+/*
+ * Times the projection of the features of the filter (h), feature by feature (Feature::compute_h) against the batch
+ * (Feature::project), for the usual numbers of features. The feature by feature one also with a distortion lookup table.
+ */
+int main(){
+	//ARDRONE:
+#if defined(EKFOA_CAMERA_PINHOLE) || defined(EKFOA_CAMERA_FISHEYE)
+	Camera cam(588.878779108602, 588.643674196636, 303.725019622098, 185.837132396075);
+	Camera cam_table = cam; //only the radial distortion has a table
+#else
+	Camera cam(588.878779108602,  //fx
+			588.643674196636,     //fy
+			303.725019622098,     //cx
+			185.837132396075,     //cy
+			-0.550446697998159,   //k1
+			0.311341231340524     //k2
+	);
+	Camera cam_table(588.878779108602, 588.643674196636, 303.725019622098, 185.837132396075, -0.550446697998159, 0.311341231340524, 0.01);
+#endif
+
+	const Vector3s rW(0.1, -0.05, 0.2);
+	const Vector4s qWR = Vector4s(0.99, 0.05, -0.08, 0.03).normalized();
+	Matrix3s qWR_rotation_matrix;
+	MotionModel::quaternion_matrix(qWR, qWR_rotation_matrix);
+
+	const int repetitions = 1000;
+	const int num_features_list[] = {30, 50, 100, 200};
+
+	for (size_t n=0 ; n<sizeof(num_features_list)/sizeof(num_features_list[0]) ; n++){
+		const int num_features = num_features_list[n];
+#ifdef EKFOA_MAX_FEATURES
+		if (num_features > EKFOA_MAX_FEATURES){
+			continue; //the lanes of the batch do not have room for them
+		}
+#endif
+
+		//Inverse depth features in front of the camera:
+		std::vector<VectorXs> features(num_features);
+		for (int i=0 ; i<num_features ; i++){
+			features[i].resize(Feature::INVERSE_DEPTH_SIZE);
+			features[i] << 0, 0, 0,
+					0.6*(std::rand()/(ekf_scalar)RAND_MAX - 0.5), //theta
+					0.4*(std::rand()/(ekf_scalar)RAND_MAX - 0.5), //phi
+					0.1 + std::rand()/(ekf_scalar)RAND_MAX;       //rho
+		}
+
+		std::vector<Vector2s> h(num_features);
+		double time_scalar = (double)cv::getTickCount();
+		for (int r=0 ; r<repetitions ; r++){
+			for (int i=0 ; i<num_features ; i++){
+				Feature::compute_h(cam, rW, qWR_rotation_matrix, features[i], h[i]);
+			}
+		}
+		time_scalar = ((double)cv::getTickCount() - time_scalar)/repetitions;
+
+		std::vector<Vector2s> h_table(num_features);
+		double time_table = (double)cv::getTickCount();
+		for (int r=0 ; r<repetitions ; r++){
+			for (int i=0 ; i<num_features ; i++){
+				Feature::compute_h(cam_table, rW, qWR_rotation_matrix, features[i], h_table[i]);
+			}
+		}
+		time_table = ((double)cv::getTickCount() - time_table)/repetitions;
+
+		FeatureProjections projections;
+		projections.resize(num_features);
+		double time_batch = (double)cv::getTickCount();
+		for (int r=0 ; r<repetitions ; r++){
+			for (int i=0 ; i<num_features ; i++){
+				Feature::set_lane(features[i], projections, i);
+			}
+			Feature::project(cam, rW, qWR_rotation_matrix, projections);
+		}
+		time_batch = ((double)cv::getTickCount() - time_batch)/repetitions;
+
+		ekf_scalar max_difference = 0, max_difference_table = 0;
+		for (int i=0 ; i<num_features ; i++){
+			max_difference = std::max(max_difference, (h[i] - Vector2s(projections.u(i), projections.v(i))).cwiseAbs().maxCoeff());
+			max_difference_table = std::max(max_difference_table, (h[i] - h_table[i]).cwiseAbs().maxCoeff());
+		}
+
+		const double ticks_per_us = cv::getTickFrequency()/1e6;
+		std::cout << num_features << " features: scalar = " << time_scalar/ticks_per_us << "us, batch = " << time_batch/ticks_per_us
+				<< "us, speedup = " << time_scalar/time_batch << ", max difference = " << max_difference << "px" << std::endl;
+		std::cout << num_features << " features: scalar with distortion table = " << time_table/ticks_per_us
+				<< "us, speedup = " << time_scalar/time_table << ", max difference = " << max_difference_table << "px" << std::endl;
+	}
+
+	return 0;
+}
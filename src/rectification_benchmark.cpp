@@ -0,0 +1,75 @@
+#include "camera.hpp"
+#include "image_rectifier.hpp"
+
+#include <opencv2/core/core.hpp> //getTickCount, randu
+
+#include <iostream> //cout
+#include <vector> //vector
+
+/*
+ * Times the whole frame rectification (ImageRectifier, EKFOA_RECTIFY_INPUT) against the per feature distortion handling it
+ * replaces in the filter: distort (Feature::compute_h) and jacob_undistort (Feature::compute_H) of every feature, every frame.
+ */
+int main(){
+	//ARDRONE:
+	const RadialCamera lens(588.878779108602, 588.643674196636, 303.725019622098, 185.837132396075, -0.550446697998159, 0.311341231340524);
+	const RadialCamera lens_table(588.878779108602, 588.643674196636, 303.725019622098, 185.837132396075, -0.550446697998159, 0.311341231340524, 0.01);
+
+	const int repetitions = 100;
+
+	//A color frame of the ARDRONE sequences:
+	cv::Mat input(360, 640, CV_8UC3);
+	cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(255));
+
+	ImageRectifier rectifier(lens_table);
+	double time_maps = (double)cv::getTickCount();
+	rectifier.rectify(input); //builds the maps
+	time_maps = (double)cv::getTickCount() - time_maps;
+
+	double time_rectify = (double)cv::getTickCount();
+	for (int r=0 ; r<repetitions ; r++){
+		rectifier.rectify(input);
+	}
+	time_rectify = ((double)cv::getTickCount() - time_rectify)/repetitions;
+
+	const double ticks_per_us = cv::getTickFrequency()/1e6;
+	std::cout << "rectification: " << time_rectify/ticks_per_us << "us per frame (maps built once in " << time_maps/ticks_per_us << "us)" << std::endl;
+
+	const int num_features_list[] = {30, 50, 100, 200};
+	for (size_t n=0 ; n<sizeof(num_features_list)/sizeof(num_features_list[0]) ; n++){
+		const int num_features = num_features_list[n];
+
+		std::vector<Vector2s> uv(num_features);
+		for (int i=0 ; i<num_features ; i++){
+			uv[i] << (i*37)%640, (i*23)%360;
+		}
+
+		Vector2s uvd;
+		Matrix2s UVU_uvd;
+		volatile ekf_scalar sink; //keeps the results alive
+		double time_newton = (double)cv::getTickCount();
+		for (int r=0 ; r<repetitions*10 ; r++){
+			for (int i=0 ; i<num_features ; i++){
+				lens.distort(uv[i], uvd);
+				lens.jacob_undistort(uvd, UVU_uvd);
+				sink = uvd(0) + UVU_uvd(0, 0);
+			}
+		}
+		time_newton = ((double)cv::getTickCount() - time_newton)/(repetitions*10);
+
+		double time_table = (double)cv::getTickCount();
+		for (int r=0 ; r<repetitions*10 ; r++){
+			for (int i=0 ; i<num_features ; i++){
+				lens_table.distort(uv[i], uvd);
+				lens_table.jacob_undistort(uvd, UVU_uvd);
+				sink = uvd(0) + UVU_uvd(0, 0);
+			}
+		}
+		time_table = ((double)cv::getTickCount() - time_table)/(repetitions*10);
+
+		std::cout << num_features << " features: per feature distortion = " << time_newton/ticks_per_us << "us (with the distortion table "
+				<< time_table/ticks_per_us << "us)" << std::endl;
+	}
+
+	return 0;
+}
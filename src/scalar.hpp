@@ -0,0 +1,41 @@
+#ifndef SCALAR_H_
+#define SCALAR_H_
+
+#include <Eigen/Core>
+
+/*
+ * EKFOA_USE_FLOAT (build option): the filter (Kalman, Feature, Camera and MotionModel) works in single precision.
+ * On ARM, NEON only vectorizes floats, so the covariance propagation and update run 4 wide instead of scalar.
+ * Otherwise everything is double precision.
+ */
+#ifdef EKFOA_USE_FLOAT
+typedef float ekf_scalar;
+#else
+typedef double ekf_scalar;
+#endif
+
+typedef Eigen::Matrix<ekf_scalar, 2, 1> Vector2s;
+typedef Eigen::Matrix<ekf_scalar, 3, 1> Vector3s;
+typedef Eigen::Matrix<ekf_scalar, 4, 1> Vector4s;
+typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, 1> VectorXs;
+typedef Eigen::Matrix<ekf_scalar, 1, 3> RowVector3s;
+typedef Eigen::Matrix<ekf_scalar, 1, 4> RowVector4s;
+typedef Eigen::Matrix<ekf_scalar, 2, 2> Matrix2s;
+typedef Eigen::Matrix<ekf_scalar, 3, 3> Matrix3s;
+typedef Eigen::Matrix<ekf_scalar, 4, 4> Matrix4s;
+typedef Eigen::Matrix<ekf_scalar, Eigen::Dynamic, Eigen::Dynamic> MatrixXs;
+typedef Eigen::Array<ekf_scalar, Eigen::Dynamic, 1> ArrayXs;
+
+/*
+ * A value per feature, the lanes of the batched projection (Feature::project, CameraModel::project_p_to_uvd). With EKFOA_MAX_FEATURES
+ * (kalman.hpp) they have a static maximum size, so neither the lanes nor the temporaries of the projection are allocated on the heap.
+ */
+#ifdef EKFOA_MAX_FEATURES
+typedef Eigen::Array<ekf_scalar, Eigen::Dynamic, 1, Eigen::ColMajor, EKFOA_MAX_FEATURES, 1> FeaturesArray;
+typedef Eigen::Array<int, Eigen::Dynamic, 1, Eigen::ColMajor, EKFOA_MAX_FEATURES, 1> FeaturesArrayi;
+#else
+typedef ArrayXs FeaturesArray;
+typedef Eigen::ArrayXi FeaturesArrayi;
+#endif
+
+#endif